@@ -119,6 +119,7 @@ to exclude the API function. */
 #define INCLUDE_vTaskDelayUntil             0
 #define INCLUDE_vTaskDelay                  1
 #define INCLUDE_xTaskGetSchedulerState      1
+#define INCLUDE_xTaskGetCurrentTaskHandle   1
 
 /* Cortex-M specific definitions. */
 #ifdef __NVIC_PRIO_BITS
@@ -46,6 +46,16 @@
  */
 #define SYS_LIGHTWEIGHT_PROT    0
 
+/* NCM_NETIF_MTU: the MTU of the NCM interface, at most 1500 as the
+   NCM class advertises standard Ethernet frames.
+   The TCP and buffer sizes are derived from it. */
+#define NCM_NETIF_MTU           1500
+
+/* NCM_NETIF_TSO: the TCP segments are split to frames by the NCM interface,
+   see the TCP options below. */
+#define NCM_NETIF_TSO           0
+#define NCM_NETIF_TSO_SIZE      (2 * (NCM_NETIF_MTU - 40))
+
 /* ---------- Memory options ---------- */
 /* MEM_ALIGNMENT: should be set to the alignment of the CPU for which
    lwIP is compiled. 4 byte alignment -> define MEM_ALIGNMENT to 4, 2
@@ -53,12 +63,18 @@
 #define MEM_ALIGNMENT           4
 
 /* MEM_SIZE: the size of the heap memory. If the application will send
-a lot of data that needs to be copied, this should be set high. */
+a lot of data that needs to be copied, this should be set high.
+   With NCM_NETIF_TSO the stack allocates whole NCM_NETIF_TSO_SIZE segments. */
+#if (NCM_NETIF_TSO == 1)
+#define MEM_SIZE                (NCM_NETIF_TSO_SIZE + 2*1024)
+#else
 #define MEM_SIZE                (3*1024)
+#endif
 
 /* MEMP_NUM_PBUF: the number of memp struct pbufs. If the application
    sends a lot of data out of ROM (or other static memory), this
-   should be set high. */
+   should be set high. Received frames don't use these, the NCM
+   interface has its own descriptors for them. */
 #define MEMP_NUM_PBUF           10
 /* MEMP_NUM_UDP_PCB: the number of UDP protocol control blocks. One
    per active UDP "connection". */
@@ -78,15 +94,31 @@ a lot of data that needs to be copied, this should be set high. */
 
 
 /* ---------- Pbuf options ---------- */
-/* PBUF_POOL_SIZE: the number of buffers in the pbuf pool. */
-#define PBUF_POOL_SIZE          4
+/* PBUF_POOL_SIZE: the number of buffers in the pbuf pool.
+   The pool takes about 6 kB, but at least 2 buffers. */
+#define PBUF_POOL_SIZE          (((6*1024) / PBUF_POOL_BUFSIZE) > 2 ? ((6*1024) / PBUF_POOL_BUFSIZE) : 2)
+
+/* PBUF_POOL_BUFSIZE: the size of each pbuf in the pbuf pool,
+   a whole frame with padding (rounded up to words). */
+#define PBUF_POOL_BUFSIZE       ((NCM_NETIF_MTU + 14 + ETH_PAD_SIZE + 3) & ~3)
+
+/* ETH_PAD_SIZE: this padding in front of the Ethernet header aligns
+   the IP header of the NCM datagrams which the host places 2 bytes after
+   a word boundary. The placement is up to the NCM class's NTB parameters
+   and the host, the other received frames are counted as rx_unaligned. */
+#define ETH_PAD_SIZE            2
 
-/* PBUF_POOL_BUFSIZE: the size of each pbuf in the pbuf pool. */
-#define PBUF_POOL_BUFSIZE       1524
+/* LWIP_SUPPORT_CUSTOM_PBUF: the NCM interface passes the received
+   datagrams in custom pbufs, referencing the transfer block. */
+#define LWIP_SUPPORT_CUSTOM_PBUF 1
 
 /* ---------- IPv4 options ---------- */
 #define LWIP_IPV4                1
 
+/* ---------- ARP options ---------- */
+/* The DHCP pool (leased to the USB host) gets static entries on link up */
+#define ETHARP_SUPPORT_STATIC_ENTRIES 1
+
 /* ---------- TCP options ---------- */
 #define LWIP_TCP                1
 #define TCP_TTL                 255
@@ -96,7 +128,7 @@ a lot of data that needs to be copied, this should be set high. */
 #define TCP_QUEUE_OOSEQ         0
 
 /* TCP Maximum segment size. */
-#define TCP_MSS                 (1500 - 40)	  /* TCP_MSS = (Ethernet MTU - IP header size - TCP header size) */
+#define TCP_MSS                 (NCM_NETIF_MTU - 40)	  /* TCP_MSS = (Ethernet MTU - IP header size - TCP header size) */
 
 /* TCP sender buffer space (bytes). */
 #define TCP_SND_BUF             (4*TCP_MSS)
@@ -108,6 +140,17 @@ a lot of data that needs to be copied, this should be set high. */
 /* TCP receive window. */
 #define TCP_WND                 (2*TCP_MSS)
 
+/* NCM_NETIF_TSO: the NCM interface splits oversized TCP segments to frames,
+   so the stack processes fewer segments. The interface fragments
+   the other IP packets as well, and switches the connections
+   to the larger segments in the TCP input hook. */
+#if (NCM_NETIF_TSO == 1)
+#define IP_FRAG                 0
+#define LWIP_HOOK_FILENAME      "ncm_netif.h"
+#define LWIP_HOOK_TCP_INPACKET_PCB(pcb, hdr, optlen, opt1len, opt2, p) \
+        ncm_netif_tcp_inpacket(pcb)
+#endif
+
 
 /* ---------- ICMP options ---------- */
 #define LWIP_ICMP               1
@@ -130,6 +173,10 @@ a lot of data that needs to be copied, this should be set high. */
 #define CHECKSUM_CHECK_UDP      1
 #define CHECKSUM_CHECK_TCP      1
 #define CHECKSUM_GEN_ICMP       1
+/* Sum the data while it's copied to the pbufs (TCP, UDP), see LWIP_CHKSUM_COPY */
+#define LWIP_CHECKSUM_ON_COPY   1
+/* The checksum policy of the USB link is set by NCM_NETIF_CHECKSUM */
+#define LWIP_CHECKSUM_CTRL_PER_NETIF 1
 
 /* ---------- OS options ---------- */
 #define TCPIP_THREAD_NAME              "TCP/IP"
@@ -141,6 +188,10 @@ a lot of data that needs to be copied, this should be set high. */
 #define DEFAULT_THREAD_STACKSIZE        500
 #define TCPIP_THREAD_PRIO               3
 
+/* The NCM interface processes each received transfer block
+ * in a single lwIP core lock */
+#define LWIP_TCPIP_CORE_LOCKING         1
+
 
 /** Set this to 1 to include "fsdata_custom.c" instead of "fsdata.c" for the
  * file system (to prevent changing the file included in CVS) */
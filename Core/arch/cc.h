@@ -32,6 +32,7 @@
 #ifndef __CC_H__
 #define __CC_H__
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <arch/cpu.h>
@@ -81,4 +82,10 @@ typedef int sys_prot_t;
 
 #define LWIP_RAND()             ((u32_t)rand())
 
+/* use the word-wise checksum routines of chksum.c */
+uint16_t arch_chksum(const void *dataptr, int len);
+uint16_t arch_chksum_copy(void *dst, const void *src, uint16_t len);
+#define LWIP_CHKSUM             arch_chksum
+#define LWIP_CHKSUM_COPY(dst, src, len) arch_chksum_copy(dst, src, len)
+
 #endif /* __CC_H__ */
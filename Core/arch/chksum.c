@@ -0,0 +1,198 @@
+/**
+  ******************************************************************************
+  * @file    chksum.c
+  * @author  agent
+  * @version 0.1
+  * @date    2026-10-17
+  * @brief   Word-wise internet checksum routines for lwIP
+  *
+  * Copyright (c) 2026 agent
+  *
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+/* Only the standard headers are used, so the routines build on the host
+ * as well (see Test/chksum_test.c) */
+#include <stdint.h>
+#include <string.h>
+
+/* The Cortex-M3/M4/M7 cores add a word per cycle with the carry chain */
+#if defined(__GNUC__) && (defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__))
+#define CHKSUM_ARM_CARRY_CHAIN  1
+#else
+#define CHKSUM_ARM_CARRY_CHAIN  0
+#endif
+
+/**
+ * @brief Calculates the one's complement sum of a memory area, while
+ *        optionally copying it. The bulk of the data is summed in words,
+ *        with the end-around carry added back in each step.
+ * @param dst: the copy destination, or NULL if only the sum is needed
+ * @param src: the start of the data
+ * @param len: the length of the data
+ * @return The 16-bit one's complement sum (not inverted)
+ */
+static inline uint16_t chksum_copy(uint8_t *dst, const uint8_t *src, int len)
+{
+    uint32_t sum = 0;
+    uint32_t w;
+    uint16_t t = 0;
+    int odd = ((uintptr_t)src & 1);
+
+    /* An odd start is summed with swapped bytes, and swapped back at the end */
+    if (odd && (len > 0))
+    {
+        ((uint8_t*)&t)[1] = *src;
+        if (dst != NULL)
+        {
+            *dst++ = *src;
+        }
+        src++;
+        len--;
+    }
+    if (((uintptr_t)src & 2) && (len >= 2))
+    {
+        uint16_t h;
+
+        memcpy(&h, src, sizeof(h));
+        sum += h;
+        if (dst != NULL)
+        {
+            memcpy(dst, &h, sizeof(h));
+            dst += 2;
+        }
+        src += 2;
+        len -= 2;
+    }
+
+#if (CHKSUM_ARM_CARRY_CHAIN == 1)
+    while (len >= 16)
+    {
+        const uint32_t *pw = (const uint32_t*)src;
+        uint32_t w0 = pw[0], w1 = pw[1], w2 = pw[2], w3 = pw[3];
+
+        __asm ("adds %0, %0, %1\n\t"
+               "adcs %0, %0, %2\n\t"
+               "adcs %0, %0, %3\n\t"
+               "adcs %0, %0, %4\n\t"
+               "adc  %0, %0, #0"
+               : "+r" (sum)
+               : "r" (w0), "r" (w1), "r" (w2), "r" (w3)
+               : "cc");
+        if (dst != NULL)
+        {
+            /* The core allows unaligned word stores */
+            memcpy(dst + 0, &w0, sizeof(w0));
+            memcpy(dst + 4, &w1, sizeof(w1));
+            memcpy(dst + 8, &w2, sizeof(w2));
+            memcpy(dst + 12, &w3, sizeof(w3));
+            dst += 16;
+        }
+        src += 16;
+        len -= 16;
+    }
+#else
+    {
+        /* Portable variant for 64-bit hosts */
+        uint64_t acc = sum, q;
+
+        while (len >= 8)
+        {
+            memcpy(&q, src, sizeof(q));
+            acc += q;
+            acc += (acc < q);
+            if (dst != NULL)
+            {
+                memcpy(dst, &q, sizeof(q));
+                dst += 8;
+            }
+            src += 8;
+            len -= 8;
+        }
+        acc = (acc & 0xFFFFFFFFUL) + (acc >> 32);
+        acc = (acc & 0xFFFFFFFFUL) + (acc >> 32);
+        sum = (uint32_t)acc;
+    }
+#endif
+    while (len >= 4)
+    {
+        memcpy(&w, src, sizeof(w));
+        sum += w;
+        sum += (sum < w);
+        if (dst != NULL)
+        {
+            memcpy(dst, &w, sizeof(w));
+            dst += 4;
+        }
+        src += 4;
+        len -= 4;
+    }
+
+    /* The remaining halfword and byte */
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    if (len >= 2)
+    {
+        uint16_t h;
+
+        memcpy(&h, src, sizeof(h));
+        sum += h;
+        if (dst != NULL)
+        {
+            memcpy(dst, &h, sizeof(h));
+            dst += 2;
+        }
+        src += 2;
+        len -= 2;
+    }
+    if (len > 0)
+    {
+        ((uint8_t*)&t)[0] = *src;
+        if (dst != NULL)
+        {
+            *dst = *src;
+        }
+    }
+    sum += t;
+
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    if (odd)
+    {
+        sum = ((sum & 0xFF) << 8) | ((sum >> 8) & 0xFF);
+    }
+    return (uint16_t)sum;
+}
+
+/**
+ * @brief Calculates the one's complement sum of a memory area, with the same
+ *        result as lwip_standard_chksum().
+ * @param dataptr: the start of the data
+ * @param len: the length of the data
+ * @return The 16-bit one's complement sum (not inverted)
+ */
+uint16_t arch_chksum(const void *dataptr, int len)
+{
+    return chksum_copy(NULL, dataptr, len);
+}
+
+/**
+ * @brief Copies a memory area and calculates its one's complement sum
+ *        in the same pass, with the same result as lwip_chksum_copy().
+ * @param dst: the copy destination
+ * @param src: the start of the data
+ * @param len: the length of the data
+ * @return The 16-bit one's complement sum (not inverted)
+ */
+uint16_t arch_chksum_copy(void *dst, const void *src, uint16_t len)
+{
+    return chksum_copy(dst, src, len);
+}
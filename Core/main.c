@@ -93,11 +93,9 @@ int main(void)
 
     while (1)
     {
-        /* perform networking */
+        /* perform networking (including the lwIP timeouts) */
         ncm_netif_process();
 
-        sys_check_timeouts();
-
         /* switch to bootloader when Detached */
         STM32_ROM_DFU_Main();
     }
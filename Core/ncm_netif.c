@@ -25,35 +25,191 @@
 
 #include <netif/ethernet.h>
 #include <lwip/etharp.h>
+#include <lwip/sys.h>
+#include <lwip/timeouts.h>
+#include <lwip/prot/ip4.h>
+#include <lwip/prot/tcp.h>
+#if (NCM_NETIF_TSO == 1)
+#include <lwip/tcp.h>
+#include <lwip/ip.h>
+#endif
+#include <lwip/prot/icmp.h>
+#include <lwip/prot/etharp.h>
+#include <lwip/inet_chksum.h>
 #include <lwip/apps/dhcp_server.h>
+#if (NCM_NETIF_RX_BACKPRESSURE == 1)
+#include <lwip/memp.h>
+#endif
 
 #if (NO_SYS == 0)
-#include <lwip/sys.h>
-/* lwIP API is used for threading,
- * this include is only necessary for portYIELD_FROM_ISR */
+#include <lwip/tcpip.h>
+/* lwIP API is used for threading, FreeRTOS is only necessary
+ * for portYIELD_FROM_ISR and the task notifications */
 #include <FreeRTOS.h>
+#include <task.h>
 
 #define NCM_NETIF_STACKSIZE     1024
 #define NCM_NETIF_PRIO          4
 #define NCM_NETIF_MBOX_SIZE     4
 
-/* Post an event to the thread's mailbox,
- * and notify scheduler if the thread should be switched to
- * (as it's priority is higher than the current task) */
-#define NCM_POST_EVENT_ISR(NCM_NETIF, MSG)   \
-    portYIELD_FROM_ISR((ERR_NEED_SCHED == sys_mbox_trypost_fromisr(&(NCM_NETIF)->events, (void*)MSG)))
+/* Event bits of the NCM thread */
+#define NCM_EV_LINK             (1 << 0)
+#define NCM_EV_RECEIVED         (1 << 1)
 #endif
 
 /* Ethernet (IEEE 802.3) transfer medium properties */
-#define ETH_MAX_PAYLOAD_SIZE    1500
 #define ETH_HEADER_SIZE         14
-#define ETH_MAX_FRAME_SIZE      (ETH_HEADER_SIZE + ETH_MAX_PAYLOAD_SIZE)
+
+#include <xpd_config.h>
+#if (__CORTEX_M >= 3)
+/* The DWT cycle counter is used for time measurements */
+#define NCM_NOW_CYCLES()                        (DWT->CYCCNT)
+#else
+/* Without DWT the system time is used, with millisecond resolution */
+#define NCM_NOW_CYCLES()                        (sys_now() * (SystemCoreClock / 1000))
+#endif
+#define NCM_US_TO_CYCLES(US)                    ((SystemCoreClock / 1000000) * (US))
+
+#if (NCM_NETIF_STATS == 1)
+#define NCM_STATS_INC(NCM_NETIF, FIELD)         ((NCM_NETIF)->stats.FIELD++)
+#define NCM_STATS_ADD(NCM_NETIF, FIELD, VAL)    ((NCM_NETIF)->stats.FIELD += (VAL))
+#define NCM_CYCLES()                            NCM_NOW_CYCLES()
+#else
+#define NCM_STATS_INC(NCM_NETIF, FIELD)         ((void)(NCM_NETIF))
+#define NCM_STATS_ADD(NCM_NETIF, FIELD, VAL)    ((void)(NCM_NETIF), (void)(VAL))
+#define NCM_CYCLES()                            0
+#endif
+
+#if (LWIP_CHECKSUM_CTRL_PER_NETIF == 1)
+#define NCM_CHECKSUM_ENABLED(NCM_NETIF, FLAG)   (((NCM_NETIF)->netif.chksum_flags & (FLAG)) != 0)
+#else
+#define NCM_CHECKSUM_ENABLED(NCM_NETIF, FLAG)   1
+#endif
+
+#if (NCM_NETIF_TX_SHAPING == 1)
+/* Token bucket of a transmit priority class */
+struct ncm_tx_bucket {
+    u32_t rate;                 /* sustained rate [bytes/s], 0 for unlimited */
+    s32_t burst;                /* bucket size [1/1000 bytes] */
+    s32_t tokens;               /* available credit [1/1000 bytes], negative after a large frame */
+    u32_t update;               /* time of the last refill [ms] */
+};
+#endif
 
 struct ncm_netif {
     struct netif netif;
     USBD_NCM_IfHandleType ncmif;
 #if (NO_SYS == 0)
+#if (NCM_NETIF_EVENT_FLAGS == 1)
+    TaskHandle_t thread;        /* receives the events as notification bits */
+#else
     sys_mbox_t events;
+#endif
+    volatile u8_t link_up;      /* the last link state set by the USB class */
+    volatile u8_t link_changes; /* counter of link state changes */
+#if (NCM_NETIF_STATS == 1)
+    volatile u8_t ev_stamped;   /* an event is pending since ev_stamp */
+    u32_t ev_stamp;             /* time of the first pending event [cycles] */
+#endif
+#if (NCM_NETIF_RX_DISPATCH == NCM_RX_DISPATCH_FRAME)
+    struct tcpip_callback_msg *tx_drain_msg;
+    volatile u8_t tx_drain_posted;
+#endif
+#if (NCM_NETIF_RX_DISPATCH == NCM_RX_DISPATCH_MSG)
+    struct tcpip_callback_msg *rx_batch_msg;
+    volatile u8_t rx_batch_posted;
+#endif
+#if (NCM_NETIF_RX_POLL == 1)
+    struct {
+        volatile u8_t active;   /* the Received notifications are masked */
+        u8_t idle;              /* consecutive empty polls */
+        u32_t mode_start;       /* time of the last mode change [ms] */
+    } poll;
+#endif
+#endif
+#if (NCM_NETIF_PACKET_FILTER == 1)
+    struct {
+        struct eth_addr joined[NCM_NETIF_MC_FILTERS];   /* multicast addresses joined by the stack */
+        u8_t joined_refs[NCM_NETIF_MC_FILTERS];         /* groups mapped to each joined address */
+    } filter;
+#endif
+    struct {
+        struct pbuf_custom desc[NCM_NETIF_RX_DESC_COUNT];
+        u16_t next;             /* the next unused descriptor */
+        volatile u16_t refs;    /* pbufs referencing the current transfer block */
+        volatile u8_t ntb_end;  /* the end of the current transfer block is reached */
+        volatile u8_t reset;    /* the USB interface was closed, the state is stale */
+#if (NCM_NETIF_STATS == 1)
+        u32_t ntb_start;        /* time of the first datagram [cycles] */
+#endif
+        u32_t budget_cycles;    /* NCM_NETIF_RX_BUDGET_US in cycles */
+#if (NCM_NETIF_GRO == 1)
+        struct pbuf *gro;       /* the merged segments, not passed to the stack yet */
+        u32_t gro_seqno;        /* the sequence number which continues them */
+        u32_t gro_sum;          /* sum of their payloads, as their checksums state */
+        u16_t gro_count;        /* the number of merged segments */
+#if (NCM_NETIF_STATS == 1)
+        u8_t gro_flow_next;     /* the flow statistics entry to replace */
+#endif
+#endif
+#if (NCM_NETIF_RX_BACKPRESSURE == 1)
+        uint8_t *pending;       /* datagram which the stack couldn't take yet */
+        u16_t pending_len;
+#if (NCM_NETIF_GRO == 1)
+        struct pbuf *gro_pending; /* merged packet which the stack couldn't take yet */
+#endif
+        volatile u8_t bp;       /* reception waits for the stack's resources */
+        u32_t bp_start;         /* time of entering backpressure [ms] */
+#endif
+    } rx;
+    struct {
+        struct {
+            struct pbuf *p[NCM_NETIF_TXQ_SIZE];
+#if (NCM_NETIF_STATS == 1)
+            u32_t time[NCM_NETIF_TXQ_SIZE]; /* time of queueing [cycles] */
+#endif
+            u8_t head;          /* index of the oldest frame */
+            u8_t count;         /* number of queued frames */
+        } cls[NCM_TX_CLASS_COUNT];
+        u8_t count;             /* number of queued frames in all classes */
+        u32_t stall_start;      /* time of the first queued frame [ms] */
+#if (NCM_NETIF_TX_AGGR == 1)
+        u32_t bytes;            /* total length of the queued frames */
+        u32_t aggr_start;       /* time of the first held frame [cycles] */
+        u32_t aggr_cycles;      /* NCM_NETIF_TX_AGGR_US in cycles */
+        u8_t aggr_timer;        /* the deadline timeout is scheduled */
+#endif
+#if (LWIP_TIMERS == 1)
+        u8_t retry_timer;       /* the retry timeout is scheduled */
+#endif
+    } txq;
+#if (NCM_NETIF_TX_SHAPING == 1)
+    struct {
+        struct ncm_tx_bucket cls[NCM_TX_CLASS_COUNT];
+        struct {
+            u16_t port;         /* TCP or UDP port, 0 if the rule is unused */
+            u8_t cls;           /* the class of the port's frames */
+        } rules[NCM_NETIF_TX_PORT_RULES];
+        u8_t timer;             /* the refill timeout is scheduled */
+    } shape;
+#endif
+#if (NCM_NETIF_TSO == 1)
+    struct {
+        struct pbuf *p;         /* the oversized packet being split */
+        u16_t offset;           /* its payload which is already sent */
+    } tso;
+#endif
+#if (NO_SYS == 1) && (LWIP_TIMERS == 1) && (NCM_NETIF_STATS == 1)
+    struct {
+        u32_t deadline;         /* time of the next lwIP timeout [ms] */
+        u8_t armed;             /* a timeout is scheduled */
+    } timers;
+#endif
+#if (NCM_NETIF_STATS == 1)
+    struct ncm_netif_stats stats;
+#if (LWIP_CHECKSUM_CTRL_PER_NETIF == 1)
+    u32_t chksum_kb_cycles;     /* measured cost of summing 1 kB */
+#endif
 #endif
 };
 
@@ -82,20 +238,136 @@ static const USBD_NCM_AppType ncm_app = {
 static const ip_addr_t ncm_if_ipaddr = NCM_NETIF_IPADDR;
 static const ip_addr_t ncm_if_netmask = IPADDR4_INIT_BYTES(255, 255, 255, 0);
 
-#if (NO_SYS == 0)
-enum {
-    NCM_EV_LINK_DOWN = 0,
-    NCM_EV_LINK_UP,
-    NCM_EV_RECEIVED,
-};
-static const uint8_t ncm_ev_link_down   = NCM_EV_LINK_DOWN;
-static const uint8_t ncm_ev_link_up     = NCM_EV_LINK_UP;
-static const uint8_t ncm_ev_received    = NCM_EV_RECEIVED;
-#endif
+/* The number of addresses leased by the DHCP server, following the interface's */
+#define NCM_DHCP_POOL_SIZE      5
 
 /* Use a single handle as multiple interfaces are a rare use-case */
 struct ncm_netif ncm_net_if;
 USBD_NCM_IfHandleType *const ncm_usb_if = &ncm_net_if.ncmif;
+#if (NCM_NETIF_STATS == 1)
+const struct ncm_netif_stats *const ncm_stats = &ncm_net_if.stats;
+#endif
+
+#if (NO_SYS == 0)
+/**
+ * @brief Signals events to the NCM thread from the USB interrupt,
+ *        and notifies the scheduler if the thread should be switched to
+ *        (as it's priority is higher than the current task).
+ * @param ncm_netif: reference to the NCM network interface
+ * @param events: the event bits to set
+ */
+static void ncm_post_event_isr(struct ncm_netif *ncm_netif, u32_t events)
+{
+    BaseType_t woken = pdFALSE;
+
+#if (NCM_NETIF_STATS == 1)
+    if (ncm_netif->ev_stamped == 0)
+    {
+        ncm_netif->ev_stamp = NCM_CYCLES();
+        ncm_netif->ev_stamped = 1;
+    }
+#endif
+#if (NCM_NETIF_EVENT_FLAGS == 1)
+    /* The bits are merged with the pending ones, nothing is lost */
+    xTaskNotifyFromISR(ncm_netif->thread, events, eSetBits, &woken);
+#else
+    switch (sys_mbox_trypost_fromisr(&ncm_netif->events, (void*)(mem_ptr_t)events))
+    {
+        case ERR_OK:
+            break;
+        case ERR_NEED_SCHED:
+            woken = pdTRUE;
+            break;
+        default:
+            NCM_STATS_INC(ncm_netif, ev_lost);
+            break;
+    }
+#endif
+    portYIELD_FROM_ISR(woken);
+}
+
+/**
+ * @brief Signals events to the NCM thread from thread context.
+ * @param ncm_netif: reference to the NCM network interface
+ * @param events: the event bits to set
+ */
+static void ncm_post_event(struct ncm_netif *ncm_netif, u32_t events)
+{
+#if (NCM_NETIF_EVENT_FLAGS == 1)
+    xTaskNotify(ncm_netif->thread, events, eSetBits);
+#else
+    if (ERR_OK != sys_mbox_trypost(&ncm_netif->events, (void*)(mem_ptr_t)events))
+    {
+        NCM_STATS_INC(ncm_netif, ev_lost);
+    }
+#endif
+}
+
+/**
+ * @brief Blocks the NCM thread until events are signalled.
+ * @param ncm_netif: reference to the NCM network interface
+ * @param timeout: the maximal time to wait [ms], 0 to wait indefinitely
+ * @return The signalled event bits, 0 on timeout
+ */
+static u32_t ncm_wait_events(struct ncm_netif *ncm_netif, u32_t timeout)
+{
+    u32_t events = 0;
+
+#if (NCM_NETIF_EVENT_FLAGS == 1)
+    (void)xTaskNotifyWait(0, 0xFFFFFFFFUL, &events,
+            (timeout == 0) ? portMAX_DELAY : pdMS_TO_TICKS(timeout));
+#else
+    void *msg;
+    if (SYS_ARCH_TIMEOUT != sys_arch_mbox_fetch(&ncm_netif->events, &msg, timeout))
+    {
+        events = (u32_t)(mem_ptr_t)msg;
+    }
+#endif
+#if (NCM_NETIF_STATS == 1)
+    if (ncm_netif->ev_stamped != 0)
+    {
+        u32_t latency = NCM_CYCLES() - ncm_netif->ev_stamp;
+
+        ncm_netif->ev_stamped = 0;
+        NCM_STATS_INC(ncm_netif, ev_wakeups);
+        NCM_STATS_ADD(ncm_netif, ev_latency_cycles, latency);
+        if (latency > ncm_netif->stats.ev_latency_max)
+        {
+            ncm_netif->stats.ev_latency_max = latency;
+        }
+    }
+#endif
+    return events;
+}
+#endif
+
+/**
+ * @brief Sets the link up. The DHCP pool is leased to the USB host only,
+ *        so its addresses get static ARP entries, which can only be added
+ *        once the interface routes them (it is up with link).
+ * @param ncm_netif: reference to the interface container structure
+ */
+static void ncm_if_link_up(struct ncm_netif *ncm_netif)
+{
+    netif_set_link_up(&ncm_netif->netif);
+
+#if (ETHARP_SUPPORT_STATIC_ENTRIES == 1)
+    {
+        ip4_addr_t addr;
+        u8_t i;
+
+        for (i = 1; i <= NCM_DHCP_POOL_SIZE; i++)
+        {
+            ip4_addr_set_u32(&addr, ip_addr_get_ip4_u32(&ncm_if_ipaddr) + lwip_htonl(i));
+            if (ERR_OK != etharp_add_static_entry(&addr, (struct eth_addr*)ncm_hwaddr))
+            {
+                /* The ARP table is full, the rest are resolved as usual */
+                break;
+            }
+        }
+    }
+#endif
+}
 
 /**
  * @brief Called when the USB NCM interface is opened.
@@ -115,9 +387,11 @@ static void ncm_app_init(void *itf)
 
 #if (NO_SYS == 1)
     /* Set Ethernet link state */
-    netif_set_link_up(&ncm_netif->netif);
+    ncm_if_link_up(ncm_netif);
 #else
-    NCM_POST_EVENT_ISR(ncm_netif, &ncm_ev_link_up);
+    ncm_netif->link_up = 1;
+    ncm_netif->link_changes++;
+    ncm_post_event_isr(ncm_netif, NCM_EV_LINK);
 #endif
 }
 
@@ -129,11 +403,17 @@ static void ncm_app_deinit(void *itf)
 {
     struct ncm_netif *ncm_netif = container_of(itf, struct ncm_netif, ncmif);
 
+    /* The held datagram and merged segments are lost with the transfer blocks,
+     * they are discarded in the processing context before the next datagram */
+    ncm_netif->rx.reset = 1;
+
 #if (NO_SYS == 1)
     /* Set Ethernet link state */
     netif_set_link_down(&ncm_netif->netif);
 #else
-    NCM_POST_EVENT_ISR(ncm_netif, &ncm_ev_link_down);
+    ncm_netif->link_up = 0;
+    ncm_netif->link_changes++;
+    ncm_post_event_isr(ncm_netif, NCM_EV_LINK);
 #endif
 }
 
@@ -146,7 +426,125 @@ static void ncm_app_received(void *itf)
 {
     struct ncm_netif *ncm_netif = container_of(itf, struct ncm_netif, ncmif);
 
-    NCM_POST_EVENT_ISR(ncm_netif, &ncm_ev_received);
+#if (NCM_NETIF_RX_POLL == 1)
+    /* The thread polls the class anyway */
+    if (ncm_netif->poll.active != 0)
+    {
+        NCM_STATS_INC(ncm_netif, rx_poll_masked);
+        return;
+    }
+#endif
+    ncm_post_event_isr(ncm_netif, NCM_EV_RECEIVED);
+}
+#endif
+
+#if (NCM_NETIF_PACKET_FILTER == 1)
+/**
+ * @brief Checks whether the stack has joined the multicast address
+ *        of the received frame. Broadcast frames are always accepted.
+ * @param ncm_netif: reference to the interface container structure
+ * @param dest: the destination MAC address of the frame
+ * @return 1 if the frame is to be dropped, 0 if it's passed on
+ */
+static u8_t ncm_rx_mc_filtered(struct ncm_netif *ncm_netif, const struct eth_addr *dest)
+{
+    u8_t i;
+
+    if (((dest->addr[0] & 1) == 0) || eth_addr_cmp(dest, &ethbroadcast))
+    {
+        return 0;
+    }
+#if (LWIP_IPV6 == 1)
+    /* IPv6 multicast (33:33:xx) is left to the stack */
+    if ((dest->addr[0] == LL_IP6_MULTICAST_ADDR_0) && (dest->addr[1] == LL_IP6_MULTICAST_ADDR_1))
+    {
+        return 0;
+    }
+#endif
+    for (i = 0; i < NCM_NETIF_MC_FILTERS; i++)
+    {
+        if ((ncm_netif->filter.joined_refs[i] > 0) &&
+            eth_addr_cmp(dest, &ncm_netif->filter.joined[i]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#if (LWIP_IGMP == 1)
+/**
+ * @brief Updates the multicast addresses accepted on reception
+ *        as the stack joins and leaves IPv4 groups.
+ * @param netif: reference of the network interface
+ * @param group: the IPv4 multicast group
+ * @param action: whether the group is joined or left
+ * @return ERR_OK if the filter is updated, ERR_MEM if the filter table is full
+ */
+static err_t ncm_if_igmp_mac_filter(struct netif *netif, const ip4_addr_t *group,
+        enum netif_mac_filter_action action)
+{
+    struct ncm_netif *ncm_netif = container_of(netif, struct ncm_netif, netif);
+    u32_t addr = lwip_ntohl(ip4_addr_get_u32(group));
+    struct eth_addr mac = {{ LL_IP4_MULTICAST_ADDR_0, LL_IP4_MULTICAST_ADDR_1, LL_IP4_MULTICAST_ADDR_2,
+            (u8_t)((addr >> 16) & 0x7F), (u8_t)(addr >> 8), (u8_t)addr }};
+    u8_t i, free = NCM_NETIF_MC_FILTERS;
+
+    /* Several groups can map to the same MAC address */
+    for (i = 0; i < NCM_NETIF_MC_FILTERS; i++)
+    {
+        if (ncm_netif->filter.joined_refs[i] == 0)
+        {
+            free = LWIP_MIN(free, i);
+        }
+        else if (eth_addr_cmp(&mac, &ncm_netif->filter.joined[i]))
+        {
+            if (action == NETIF_ADD_MAC_FILTER)
+            {
+                ncm_netif->filter.joined_refs[i]++;
+            }
+            else
+            {
+                ncm_netif->filter.joined_refs[i]--;
+            }
+            return ERR_OK;
+        }
+    }
+    if (action == NETIF_DEL_MAC_FILTER)
+    {
+        return ERR_OK;
+    }
+    else if (free == NCM_NETIF_MC_FILTERS)
+    {
+        return ERR_MEM;
+    }
+
+    SMEMCPY(&ncm_netif->filter.joined[free], &mac, ETH_HWADDR_LEN);
+    ncm_netif->filter.joined_refs[free] = 1;
+    return ERR_OK;
+}
+#endif
+#endif
+
+#if (NCM_NETIF_P2P == 1)
+/**
+ * @brief Sends an IP packet on the point-to-point link. The USB host is
+ *        the only peer, so its MAC address is used without ARP resolution.
+ * @param netif: reference of the network interface
+ * @param p: the IP packet to send
+ * @param ipaddr: the IP address of the destination
+ * @return ERR_OK if the packet is sent or queued
+ *         an err_t value if the packet couldn't be sent
+ */
+static err_t ncm_if_p2p_output(struct netif *netif, struct pbuf *p, const ip4_addr_t *ipaddr)
+{
+    /* Broadcast and multicast packets have their own MAC addresses */
+    if (ip4_addr_isbroadcast(ipaddr, netif) || ip4_addr_ismulticast(ipaddr))
+    {
+        return etharp_output(netif, p, ipaddr);
+    }
+    return ethernet_output(netif, p, (const struct eth_addr*)netif->hwaddr,
+            (const struct eth_addr*)ncm_hwaddr, ETHTYPE_IP);
 }
 #endif
 
@@ -161,154 +559,2355 @@ static err_t ncm_if_init(struct netif *netif)
     SMEMCPY(netif->hwaddr, ncm_hwaddr, ETH_HWADDR_LEN);
     netif->hwaddr[ETH_HWADDR_LEN - 1]++;
     netif->hwaddr_len = ETH_HWADDR_LEN;
-    netif->mtu        = ETH_MAX_PAYLOAD_SIZE;
+    netif->mtu        = NCM_NETIF_MTU;
     netif->flags      = 0;
+#if (NCM_NETIF_P2P == 1)
+    netif->output     = ncm_if_p2p_output;
+#else
     netif->output     = etharp_output;
+#endif
     netif->linkoutput = ncm_if_output;
     netif->flags |= NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP;
+#if (LWIP_IGMP == 1)
+    netif->flags |= NETIF_FLAG_IGMP;
+#if (NCM_NETIF_PACKET_FILTER == 1)
+    netif_set_igmp_mac_filter(netif, ncm_if_igmp_mac_filter);
+#endif
+#endif
 
     return ERR_OK;
 }
 
+#if (NCM_NETIF_TSO == 1) || (NCM_NETIF_GRO == 1)
 /**
- * @brief This function copies the passed datagram to the NCM transfer block.
- * @param netif: reference of the network interface
- * @param p: the MAC packet to send
- * @return ERR_OK if the packet could be sent
- *         an err_t value if the packet couldn't be sent
+ * @brief Sums the TCP pseudo header of an IPv4 packet.
+ * @param iphdr: the IP header of the packet
+ * @param len: the length of the TCP header and payload
+ * @return The unfolded ones' complement sum
  */
-static err_t ncm_if_output(struct netif *netif, struct pbuf *p)
+static u32_t ncm_tcp_pseudo_sum(const struct ip_hdr *iphdr, u16_t len)
 {
-    err_t retval = ERR_BUF;
-    uint8_t* dest;
+    u32_t addr, acc;
 
-    do /* As lwIP doesn't retransmit, loop here until successful */
-    {
-        /* Cannot use USBD_NCM_PutDatagram as chained pbufs are non-linear in memory */
-        dest = USBD_NCM_AllocDatagram(netif->state, p->tot_len);
+    addr = ip4_addr_get_u32(&iphdr->src);
+    acc = (addr & 0xFFFFUL) + (addr >> 16);
+    addr = ip4_addr_get_u32(&iphdr->dest);
+    acc += (addr & 0xFFFFUL) + (addr >> 16);
+    acc += (u32_t)lwip_htons(IP_PROTO_TCP) + (u32_t)lwip_htons(len);
+    return acc;
+}
 
-        if (dest != NULL)
-        {
-            /* Copy all segments to the datagram */
-            while (p != NULL)
-            {
-                SMEMCPY(dest, p->payload, p->len);
-                dest += p->len;
+/**
+ * @brief Folds a ones' complement sum to 16 bits.
+ * @param acc: the unfolded sum
+ * @return The folded sum
+ */
+static u16_t ncm_chksum_fold(u32_t acc)
+{
+    acc = (acc >> 16) + (acc & 0xFFFFUL);
+    acc = (acc >> 16) + (acc & 0xFFFFUL);
+    return (u16_t)acc;
+}
+#endif
 
-                if (p->len == p->tot_len)
-                {   break; }
+#if (NCM_NETIF_TSO == 1)
+/**
+ * @brief Copies a part of a packet to the transfer block, and calculates
+ *        the ones' complement sum of the copied data in the same pass.
+ * @param p: the packet to copy from
+ * @param dest: the destination in the transfer block
+ * @param len: the length to copy
+ * @param offset: the offset of the part in the packet
+ * @return The unfolded sum of the copied data
+ */
+static u32_t ncm_pbuf_copy_chksum(const struct pbuf *p, u8_t *dest, u16_t len, u16_t offset)
+{
+    u32_t acc = 0;
+    u16_t copied = 0;
 
-                p = p->next;
-            }
+    for (; (p != NULL) && (copied < len); p = p->next)
+    {
+        const u8_t *src;
+        u16_t sum, n;
 
-            /* SetDatagram must be called after a successful AllocDatagram */
-            if (USBD_E_OK == USBD_NCM_SetDatagram(netif->state))
-            {
-                retval = ERR_OK;
-            }
-        }
-#if (NO_SYS == 0)
-        else
+        if (offset >= p->len)
         {
-            /* TODO: log occurrences
-             * Maybe delay the current thread to prevent starving others,
-             * but effect on lwIP call stack needs to be considered. */
+            offset -= p->len;
+            continue;
         }
+        src = (const u8_t*)p->payload + offset;
+        n = LWIP_MIN(p->len - offset, len - copied);
+#if (LWIP_CHECKSUM_ON_COPY == 1)
+        sum = LWIP_CHKSUM_COPY(dest + copied, src, n);
+#else
+        MEMCPY(dest + copied, src, n);
+        sum = LWIP_CHKSUM(dest + copied, n);
 #endif
+        /* The bytes of a part at an odd position are summed swapped */
+        if ((copied & 1) != 0)
+        {
+            sum = SWAP_BYTES_IN_WORD(sum);
+        }
+        acc += sum;
+        copied += n;
+        offset = 0;
     }
-    while (retval != ERR_OK);
+    return acc;
+}
 
-    return retval;
+/**
+ * @brief Calculates the TCP checksum of a frame in the transfer block.
+ * @param iphdr: the IP header of the frame
+ * @param tcphdr: the TCP header
+ * @param hlen: the length of the TCP header
+ * @param payload_sum: the unfolded sum of the payload
+ * @param len: the length of the payload
+ * @return The TCP checksum
+ */
+static u16_t ncm_tcp_chksum(const struct ip_hdr *iphdr, const void *tcphdr, u16_t hlen,
+        u32_t payload_sum, u16_t len)
+{
+    return (u16_t)~ncm_chksum_fold(LWIP_CHKSUM(tcphdr, hlen) + payload_sum +
+            ncm_tcp_pseudo_sum(iphdr, hlen + len));
 }
 
 /**
- * @brief Passes the received datagrams to the lwIP stack as Ethernet packets.
+ * @brief Splits an IP packet above the MTU to frames directly in the transfer
+ *        block: TCP segments are cut at the MSS with their sequence numbers
+ *        and checksums updated (segmentation offload), other packets
+ *        are fragmented. When the transfer blocks are full, the progress
+ *        is kept, and the next call with the same packet continues it.
  * @param ncm_netif: reference to the interface container structure
- * @return ERR_OK if a datagram is processed, otherwise ERR_CONN
+ * @param p: the MAC packet to send
+ * @return ERR_OK if all frames are sent, ERR_MEM if the transfer blocks are full,
+ *         ERR_VAL if the packet can't be split, ERR_IF if a frame can't be set
  */
-static err_t ncm_netif_process_one(struct ncm_netif *ncm_netif)
+static err_t ncm_tx_put_segments(struct ncm_netif *ncm_netif, struct pbuf *p)
 {
-    err_t retval = ERR_CONN;
-    uint8_t* dg;
-    uint16_t len;
+    const struct eth_hdr *ethhdr = p->payload;
+    const struct ip_hdr *iphdr = (const struct ip_hdr *)((const u8_t*)p->payload + SIZEOF_ETH_HDR);
+    u16_t ip_hlen, hdr_len, chunk, total, offset, len;
+    u8_t tcp;
 
-    dg = USBD_NCM_GetDatagram(&ncm_netif->ncmif, &len);
+    /* The stack places all headers in the first pbuf */
+    if ((ethhdr->type != PP_HTONS(ETHTYPE_IP)) || (p->len < (SIZEOF_ETH_HDR + IP_HLEN)))
+    {
+        NCM_STATS_INC(ncm_netif, tx_dropped);
+        return ERR_VAL;
+    }
+    ip_hlen = IPH_HL_BYTES(iphdr);
+    tcp = (IPH_PROTO(iphdr) == IP_PROTO_TCP) && (p->len >= (SIZEOF_ETH_HDR + ip_hlen + TCP_HLEN));
 
-    if (len > 0)
+    if (tcp)
     {
-        struct pbuf *p = pbuf_alloc_reference(dg, len, PBUF_ROM);
+        const struct tcp_hdr *tcphdr = (const struct tcp_hdr *)((const u8_t*)iphdr + ip_hlen);
 
-        /* Process the Ethernet frame (== ethernet_input) */
-        retval = ncm_netif->netif.input(p, &ncm_netif->netif);
+        hdr_len = ETH_HEADER_SIZE + ip_hlen + TCPH_HDRLEN_BYTES(tcphdr);
+        chunk = ncm_netif->netif.mtu - (hdr_len - ETH_HEADER_SIZE);
     }
-    return retval;
-}
-
-#if (NO_SYS == 1)
-/**
- * @brief Passes the received datagrams to the lwIP stack as Ethernet packets.
- */
-void ncm_netif_process(void)
-{
-    struct ncm_netif *ncm_netif = &ncm_net_if;
+    else
+    {
+        /* Fragments are cut at 8 byte boundaries */
+        hdr_len = ETH_HEADER_SIZE + ip_hlen;
+        chunk = (ncm_netif->netif.mtu - ip_hlen) & ~7;
+    }
+    if ((p->len < (ETH_PAD_SIZE + hdr_len)) ||
+        (!tcp && ((IPH_OFFSET(iphdr) & PP_HTONS(IP_DF)) != 0)))
+    {
+        NCM_STATS_INC(ncm_netif, tx_dropped);
+        return ERR_VAL;
+    }
+    total = p->tot_len - ETH_PAD_SIZE - hdr_len;
 
-    while (ERR_OK == ncm_netif_process_one(ncm_netif));
-}
-#else
-/**
- * @brief This thread receives the NCM events in blocking mode and processes them.
- * @param ncm_netif: reference to the interface container structure
- */
-static void ncm_netif_thread(struct ncm_netif *ncm_netif)
-{
-    uint8_t *event;
+    if (ncm_netif->tso.p != p)
+    {
+        ncm_netif->tso.p = p;
+        ncm_netif->tso.offset = 0;
+    }
 
-    while (1) /* event loop */
+    for (offset = ncm_netif->tso.offset; offset < total; offset += len)
     {
-        /* Wait for next event indefinitely */
-        if (SYS_ARCH_TIMEOUT != sys_arch_mbox_fetch(&ncm_netif->events, (void**)&event, 0))
+        struct ip_hdr *fiphdr;
+        u8_t *dest;
+        u32_t payload_sum = 0;
+
+        len = LWIP_MIN(chunk, total - offset);
+        dest = USBD_NCM_AllocDatagram(&ncm_netif->ncmif, hdr_len + len);
+        if (dest == NULL)
+        {
+            /* All IN transfer blocks of the class are full */
+            NCM_STATS_INC(ncm_netif, tx_ntb_full);
+            ncm_netif->tso.offset = offset;
+            return ERR_MEM;
+        }
+
+        /* Copy the headers and this frame's part of the payload,
+         * the segment's payload is summed while it's copied */
+        pbuf_copy_partial(p, dest, hdr_len, ETH_PAD_SIZE);
+        if (tcp)
+        {
+            payload_sum = ncm_pbuf_copy_chksum(p, dest + hdr_len, len, ETH_PAD_SIZE + hdr_len + offset);
+        }
+        else
+        {
+            pbuf_copy_partial(p, dest + hdr_len, len, ETH_PAD_SIZE + hdr_len + offset);
+        }
+
+        fiphdr = (struct ip_hdr *)(dest + ETH_HEADER_SIZE);
+        IPH_LEN_SET(fiphdr, lwip_htons(hdr_len - ETH_HEADER_SIZE + len));
+
+        if (tcp)
+        {
+            struct tcp_hdr *tcphdr = (struct tcp_hdr *)((u8_t*)fiphdr + ip_hlen);
+
+            /* Each frame is a separate IP packet */
+            IPH_ID_SET(fiphdr, lwip_htons((u16_t)(lwip_ntohs(IPH_ID(iphdr)) + (offset / chunk))));
+            tcphdr->seqno = lwip_htonl(lwip_ntohl(tcphdr->seqno) + offset);
+            if ((offset + len) < total)
+            {
+                TCPH_UNSET_FLAG(tcphdr, TCP_FIN | TCP_PSH);
+            }
+            tcphdr->chksum = 0;
+            tcphdr->chksum = ncm_tcp_chksum(fiphdr, tcphdr, hdr_len - ETH_HEADER_SIZE - ip_hlen,
+                    payload_sum, len);
+        }
+        else
         {
-            switch (*event)
+            u16_t frag = lwip_ntohs(IPH_OFFSET(iphdr));
+
+            /* The last fragment keeps the original more fragments flag */
+            frag = (frag & IP_MF) | ((frag & IP_OFFMASK) + (offset / 8));
+            if ((offset + len) < total)
             {
-                case NCM_EV_LINK_DOWN:
-                    netif_set_link_down(&ncm_netif->netif);
-                    break;
-                case NCM_EV_LINK_UP:
-                    netif_set_link_up(&ncm_netif->netif);
-                    break;
-                case NCM_EV_RECEIVED:
-                    /* Consume all received datagrams */
-                    while (ERR_OK == ncm_netif_process_one(ncm_netif));
-                    break;
+                frag |= IP_MF;
             }
+            IPH_OFFSET_SET(fiphdr, lwip_htons(frag));
+        }
+        IPH_CHKSUM_SET(fiphdr, 0);
+        IPH_CHKSUM_SET(fiphdr, inet_chksum(fiphdr, ip_hlen));
+
+        /* SetDatagram must be called after a successful AllocDatagram */
+        if (USBD_E_OK != USBD_NCM_SetDatagram(&ncm_netif->ncmif))
+        {
+            ncm_netif->tso.p = NULL;
+            return ERR_IF;
         }
+        NCM_STATS_INC(ncm_netif, tx_tso_frames);
     }
+
+    ncm_netif->tso.p = NULL;
+    NCM_STATS_INC(ncm_netif, tx_tso_packets);
+    return ERR_OK;
 }
-#endif
 
 /**
- * @brief Initializes the NCM network interface as a DHCP server.
+ * @brief TCP input hook (LWIP_HOOK_TCP_INPACKET_PCB), which switches the
+ *        established connections of the interface to NCM_NETIF_TSO_SIZE
+ *        segments, if the host accepts full sized frames.
+ * @param pcb: the TCP connection of the received segment
+ * @return ERR_OK to continue processing the segment
  */
-void ncm_netif_init(void)
+err_t ncm_netif_tcp_inpacket(struct tcp_pcb *pcb)
 {
-    struct ncm_netif *ncm_netif = &ncm_net_if;
-    ip4_addr_t dhcp_ip4;
+    struct netif *netif = &ncm_net_if.netif;
 
-    ncm_netif->ncmif.App = &ncm_app;
-
-    netif_add(&ncm_netif->netif, &ncm_if_ipaddr, &ncm_if_netmask, &ncm_if_ipaddr,
-            &ncm_netif->ncmif, &ncm_if_init, &ethernet_input);
+    /* The accepted connections aren't bound to the interface (netif_idx),
+     * the segment's input interface tells where the connection runs */
+    if ((pcb->state == ESTABLISHED) &&
+#if (LWIP_SINGLE_NETIF == 0)
+        (ip_current_input_netif() == netif) &&
+#endif
+        (pcb->mss == (netif->mtu - IP_HLEN - TCP_HLEN)))
+    {
+        pcb->mss = NCM_NETIF_TSO_SIZE;
+    }
+    return ERR_OK;
+}
+#endif
+
+/**
+ * @brief Copies a frame to the NCM transfer block.
+ * @param ncm_netif: reference to the interface container structure
+ * @param p: the MAC packet to send
+ * @return ERR_OK if the packet is sent,
+ *         ERR_MEM if the transfer block is currently full
+ */
+static err_t ncm_tx_put(struct ncm_netif *ncm_netif, struct pbuf *p)
+{
+    err_t retval = ERR_MEM;
+    uint8_t* dest;
+    uint32_t start;
+
+#if (NCM_NETIF_TSO == 1)
+    if (p->tot_len > (SIZEOF_ETH_HDR + ncm_netif->netif.mtu))
+    {
+        return ncm_tx_put_segments(ncm_netif, p);
+    }
+#endif
+
+    /* Cannot use USBD_NCM_PutDatagram as chained pbufs are non-linear in memory */
+    dest = USBD_NCM_AllocDatagram(&ncm_netif->ncmif, p->tot_len - ETH_PAD_SIZE);
+
+    if (dest != NULL)
+    {
+        struct pbuf *q = p;
+        u16_t pad = ETH_PAD_SIZE;
+        start = NCM_CYCLES();
+
+        /* Copy all segments to the datagram, without the padding */
+        while (q != NULL)
+        {
+            SMEMCPY(dest, (u8_t*)q->payload + pad, q->len - pad);
+            dest += q->len - pad;
+            pad = 0;
+
+            if (q->len == q->tot_len)
+            {   break; }
+
+            q = q->next;
+        }
+
+        NCM_STATS_ADD(ncm_netif, tx_copy_bytes, p->tot_len);
+        NCM_STATS_ADD(ncm_netif, tx_copy_cycles, NCM_CYCLES() - start);
+
+        /* SetDatagram must be called after a successful AllocDatagram */
+        retval = (USBD_E_OK == USBD_NCM_SetDatagram(&ncm_netif->ncmif)) ? ERR_OK : ERR_IF;
+    }
+    else
+    {
+        /* All IN transfer blocks of the class are full */
+        NCM_STATS_INC(ncm_netif, tx_ntb_full);
+    }
+    return retval;
+}
+
+/**
+ * @brief Selects the transmit priority class of a frame, so small control
+ *        frames don't wait behind bulk data.
+ * @param p: the MAC packet to send
+ * @return The priority class of the frame
+ */
+static u8_t ncm_tx_classify(struct ncm_netif *ncm_netif, struct pbuf *p)
+{
+    const struct eth_hdr *ethhdr = p->payload;
+    const struct ip_hdr *iphdr;
+    const struct tcp_hdr *tcphdr;
+    u16_t iphlen;
+
+    LWIP_UNUSED_ARG(ncm_netif);
+
+    if (p->len < (SIZEOF_ETH_HDR + IP_HLEN))
+    {
+        return (p->len >= SIZEOF_ETH_HDR) && (ethhdr->type == PP_HTONS(ETHTYPE_ARP)) ?
+                NCM_TX_CLASS_HIGH : NCM_TX_CLASS_BULK;
+    }
+
+    switch (ethhdr->type)
+    {
+        case PP_HTONS(ETHTYPE_ARP):
+            return NCM_TX_CLASS_HIGH;
+
+        case PP_HTONS(ETHTYPE_IP):
+            iphdr = (const struct ip_hdr*)((const u8_t*)p->payload + SIZEOF_ETH_HDR);
+            iphlen = IPH_HL_BYTES(iphdr);
+
+            if (IPH_PROTO(iphdr) == IP_PROTO_ICMP)
+            {
+                return NCM_TX_CLASS_HIGH;
+            }
+#if (NCM_NETIF_TX_SHAPING == 1)
+            /* The port rules take precedence, TCP and UDP ports are at the same place */
+            if (((IPH_PROTO(iphdr) == IP_PROTO_TCP) || (IPH_PROTO(iphdr) == IP_PROTO_UDP)) &&
+                (p->len >= (SIZEOF_ETH_HDR + iphlen + 4)))
+            {
+                const u16_t *ports = (const u16_t*)((const u8_t*)iphdr + iphlen);
+                int i;
+
+                for (i = 0; i < NCM_NETIF_TX_PORT_RULES; i++)
+                {
+                    u16_t port = PP_HTONS(ncm_netif->shape.rules[i].port);
+
+                    if ((port != 0) && ((ports[0] == port) || (ports[1] == port)))
+                    {
+                        return ncm_netif->shape.rules[i].cls;
+                    }
+                }
+            }
+#endif
+            /* Pure ACKs (without data or connection control flags) */
+            if ((IPH_PROTO(iphdr) == IP_PROTO_TCP) &&
+                (p->len >= (SIZEOF_ETH_HDR + iphlen + TCP_HLEN)))
+            {
+                tcphdr = (const struct tcp_hdr*)((const u8_t*)iphdr + iphlen);
+                if ((lwip_ntohs(IPH_LEN(iphdr)) == (iphlen + TCPH_HDRLEN_BYTES(tcphdr))) &&
+                    ((TCPH_FLAGS(tcphdr) & (TCP_SYN | TCP_FIN | TCP_RST)) == 0))
+                {
+                    return NCM_TX_CLASS_HIGH;
+                }
+            }
+            break;
+
+        default:
+            break;
+    }
+    return NCM_TX_CLASS_BULK;
+}
+
+/**
+ * @brief Queues a frame which cannot be sent yet.
+ * @param ncm_netif: reference to the interface container structure
+ * @param p: the MAC packet to send
+ * @param cls: the priority class of the frame
+ * @return ERR_OK if the packet is queued, otherwise the packet is dropped,
+ *         and ERR_MEM is returned if @ref NCM_NETIF_TXQ_ERR_MEM is set
+ */
+static err_t ncm_txq_push(struct ncm_netif *ncm_netif, struct pbuf *p, u8_t cls)
+{
+    err_t retval = ERR_OK;
+    u8_t tail;
+
+    if (ncm_netif->txq.cls[cls].count < NCM_NETIF_TXQ_SIZE)
+    {
+        if (ncm_netif->txq.count == 0)
+        {
+            ncm_netif->txq.stall_start = sys_now();
+        }
+
+        tail = (ncm_netif->txq.cls[cls].head + ncm_netif->txq.cls[cls].count) % NCM_NETIF_TXQ_SIZE;
+
+        /* The pbuf is kept until it's copied to the transfer block,
+         * except for volatile payload (PBUF_REF), which is copied now */
+        if (PBUF_NEEDS_COPY(p))
+        {
+            struct pbuf *q = pbuf_clone(PBUF_RAW, PBUF_RAM, p);
+
+#if (NCM_NETIF_TSO == 1)
+            /* A partly sent packet is continued from its copy */
+            if (ncm_netif->tso.p == p)
+            {
+                ncm_netif->tso.p = q;
+            }
+#endif
+            if (q == NULL)
+            {
+                NCM_STATS_INC(ncm_netif, tx_dropped);
+                return ERR_MEM;
+            }
+            p = q;
+        }
+        else
+        {
+            pbuf_ref(p);
+        }
+        ncm_netif->txq.cls[cls].p[tail] = p;
+        ncm_netif->txq.cls[cls].count++;
+        ncm_netif->txq.count++;
+#if (NCM_NETIF_TX_AGGR == 1)
+        ncm_netif->txq.bytes += p->tot_len;
+#endif
+
+        NCM_STATS_INC(ncm_netif, tx_enqueued);
+#if (NCM_NETIF_STATS == 1)
+        ncm_netif->txq.cls[cls].time[tail] = NCM_CYCLES();
+        if (ncm_netif->stats.tx_queue_hwm < ncm_netif->txq.count)
+        {
+            ncm_netif->stats.tx_queue_hwm = ncm_netif->txq.count;
+        }
+        if (ncm_netif->stats.tx_class_queue_hwm[cls] < ncm_netif->txq.cls[cls].count)
+        {
+            ncm_netif->stats.tx_class_queue_hwm[cls] = ncm_netif->txq.cls[cls].count;
+        }
+#endif
+    }
+    else
+    {
+#if (NCM_NETIF_TSO == 1)
+        /* The stack might resend it, modified, in the same pbuf */
+        if (ncm_netif->tso.p == p)
+        {
+            ncm_netif->tso.p = NULL;
+        }
+#endif
+        NCM_STATS_INC(ncm_netif, tx_dropped);
+#if (NCM_NETIF_TXQ_ERR_MEM == 1)
+        retval = ERR_MEM;
+#endif
+    }
+    return retval;
+}
+
+#if (NCM_NETIF_TX_AGGR == 1)
+static void ncm_tx_aggr_timeout(void *arg);
+#endif
+#if (LWIP_TIMERS == 1)
+static void ncm_tx_retry_timeout(void *arg);
+#endif
+
+#if (NCM_NETIF_TX_SHAPING == 1)
+/**
+ * @brief Checks whether the token bucket of the class allows sending,
+ *        after refilling it for the time passed. A class can send while its
+ *        credit isn't negative, so frames larger than the burst still pass.
+ * @param ncm_netif: reference to the interface container structure
+ * @param cls: the priority class
+ * @return 1 if the class can send, 0 if it's held by its rate limit
+ */
+static u8_t ncm_tx_shape_allow(struct ncm_netif *ncm_netif, u8_t cls)
+{
+    struct ncm_tx_bucket *bucket = &ncm_netif->shape.cls[cls];
+    u32_t now;
+    uint64_t credit;
+
+    if (bucket->rate == 0)
+    {
+        return 1;
+    }
+
+    /* bytes/s * ms = 1/1000 bytes */
+    now = sys_now();
+    credit = (uint64_t)bucket->rate * (now - bucket->update);
+    bucket->update = now;
+    if (credit >= (uint64_t)(bucket->burst - bucket->tokens))
+    {
+        bucket->tokens = bucket->burst;
+    }
+    else
+    {
+        bucket->tokens += (s32_t)credit;
+    }
+    return bucket->tokens >= 0;
+}
+
+/**
+ * @brief Takes the sent frame's length from the token bucket of its class.
+ * @param ncm_netif: reference to the interface container structure
+ * @param cls: the priority class
+ * @param len: the length of the sent frame
+ */
+static void ncm_tx_shape_charge(struct ncm_netif *ncm_netif, u8_t cls, u16_t len)
+{
+    if (ncm_netif->shape.cls[cls].rate != 0)
+    {
+        ncm_netif->shape.cls[cls].tokens -= (s32_t)len * 1000;
+    }
+}
+
+static void ncm_tx_drain(struct ncm_netif *ncm_netif);
+
+/**
+ * @brief Continues sending the frames which were held by their rate limit.
+ * @param arg: reference to the interface container structure
+ */
+static void ncm_tx_shape_timeout(void *arg)
+{
+    struct ncm_netif *ncm_netif = arg;
+
+    ncm_netif->shape.timer = 0;
+    ncm_tx_drain(ncm_netif);
+}
+
+/**
+ * @brief Schedules sending the held frames, when the first of their classes
+ *        has credit again.
+ * @param ncm_netif: reference to the interface container structure
+ */
+static void ncm_tx_shape_schedule(struct ncm_netif *ncm_netif)
+{
+    u32_t wait = 0xFFFFFFFFUL;
+    u8_t cls;
+
+    if (ncm_netif->shape.timer != 0)
+    {
+        return;
+    }
+    for (cls = 0; cls < NCM_TX_CLASS_COUNT; cls++)
+    {
+        struct ncm_tx_bucket *bucket = &ncm_netif->shape.cls[cls];
+
+        if ((ncm_netif->txq.cls[cls].count > 0) && (bucket->rate != 0))
+        {
+            wait = LWIP_MIN(wait, ((u32_t)-bucket->tokens + bucket->rate - 1) / bucket->rate);
+        }
+    }
+    if (wait == 0xFFFFFFFFUL)
+    {
+        /* No held frames */
+        return;
+    }
+    ncm_netif->shape.timer = 1;
+    sys_timeout(LWIP_MAX(wait, 1), ncm_tx_shape_timeout, ncm_netif);
+}
+
+/**
+ * @brief Sets the rate limit of a transmit priority class. Must be called
+ *        from the lwIP core's context (the TCP/IP thread or with the core locked).
+ * @param cls: the transmit priority class (NCM_TX_CLASS_*)
+ * @param rate: the sustained rate [bytes/s], 0 for unlimited
+ * @param burst: the bytes which can be sent at once after idling (below 2 MB)
+ */
+void ncm_netif_tx_shape(u8_t cls, u32_t rate, u32_t burst)
+{
+    struct ncm_netif *ncm_netif = &ncm_net_if;
+    struct ncm_tx_bucket *bucket = &ncm_netif->shape.cls[cls];
+
+    LWIP_ASSERT("invalid class", cls < NCM_TX_CLASS_COUNT);
+
+    bucket->rate = rate;
+    bucket->burst = (s32_t)burst * 1000;
+    bucket->tokens = bucket->burst;
+    bucket->update = sys_now();
+
+    /* The held frames might be sent now */
+    ncm_tx_drain(ncm_netif);
+}
+
+/**
+ * @brief Assigns the frames of a TCP or UDP port (either source or destination)
+ *        to a transmit priority class. Must be called from the lwIP core's context.
+ * @param index: the index of the rule (below NCM_NETIF_TX_PORT_RULES)
+ * @param port: the port, 0 to remove the rule
+ * @param cls: the transmit priority class (NCM_TX_CLASS_*)
+ */
+void ncm_netif_tx_port_class(u8_t index, u16_t port, u8_t cls)
+{
+    struct ncm_netif *ncm_netif = &ncm_net_if;
+
+    LWIP_ASSERT("invalid rule", index < NCM_NETIF_TX_PORT_RULES);
+    LWIP_ASSERT("invalid class", cls < NCM_TX_CLASS_COUNT);
+
+    ncm_netif->shape.rules[index].port = port;
+    ncm_netif->shape.rules[index].cls = cls;
+}
+#endif
+
+/**
+ * @brief Moves as many queued frames to the transfer block as it can fit.
+ * @param ncm_netif: reference to the interface container structure
+ */
+static void ncm_tx_drain(struct ncm_netif *ncm_netif)
+{
+    struct pbuf *p;
+    u8_t cls = 0;
+
+    while (ncm_netif->txq.count > 0)
+    {
+#if (NCM_NETIF_TX_SHAPING == 1)
+        /* The higher priority frames are sent first, unless rate limited */
+        for (cls = 0; cls < NCM_TX_CLASS_COUNT; cls++)
+        {
+            if (ncm_netif->txq.cls[cls].count == 0)
+            {   continue; }
+            if (ncm_tx_shape_allow(ncm_netif, cls) != 0)
+            {   break; }
+            NCM_STATS_INC(ncm_netif, tx_class_shaped[cls]);
+        }
+        if (cls == NCM_TX_CLASS_COUNT)
+        {
+            /* All queued frames are held until their classes have credit */
+            ncm_tx_shape_schedule(ncm_netif);
+            break;
+        }
+#else
+        /* The higher priority frames are sent first */
+        while (ncm_netif->txq.cls[cls].count == 0)
+        {
+            cls++;
+        }
+#endif
+        p = ncm_netif->txq.cls[cls].p[ncm_netif->txq.cls[cls].head];
+
+        if (ERR_MEM == ncm_tx_put(ncm_netif, p))
+        {
+#if (LWIP_TIMERS == 1)
+            /* The class doesn't signal the IN transfer completions,
+             * so the queue is retried until the transfer block has space */
+            if (ncm_netif->txq.retry_timer == 0)
+            {
+                ncm_netif->txq.retry_timer = 1;
+                sys_timeout(NCM_NETIF_TX_RETRY, ncm_tx_retry_timeout, ncm_netif);
+            }
+#endif
+            break;
+        }
+#if (NCM_NETIF_TX_SHAPING == 1)
+        ncm_tx_shape_charge(ncm_netif, cls, p->tot_len - ETH_PAD_SIZE);
+#endif
+
+#if (NCM_NETIF_STATS == 1)
+        {
+            u32_t latency = NCM_CYCLES() - ncm_netif->txq.cls[cls].time[ncm_netif->txq.cls[cls].head];
+
+            ncm_netif->stats.tx_class_latency[cls] += latency;
+            if (ncm_netif->stats.tx_class_latency_max[cls] < latency)
+            {
+                ncm_netif->stats.tx_class_latency_max[cls] = latency;
+            }
+        }
+#endif
+
+        /* Sent (or failed for good), release the queue's reference */
+#if (NCM_NETIF_TX_AGGR == 1)
+        ncm_netif->txq.bytes -= p->tot_len;
+#endif
+#if (NCM_NETIF_TSO == 1)
+        if (ncm_netif->tso.p == p)
+        {
+            ncm_netif->tso.p = NULL;
+        }
+#endif
+        pbuf_free(p);
+        ncm_netif->txq.cls[cls].head = (ncm_netif->txq.cls[cls].head + 1) % NCM_NETIF_TXQ_SIZE;
+        ncm_netif->txq.cls[cls].count--;
+        ncm_netif->txq.count--;
+
+        if (ncm_netif->txq.count == 0)
+        {
+#if (NCM_NETIF_STATS == 1)
+            u32_t stall = sys_now() - ncm_netif->txq.stall_start;
+
+            ncm_netif->stats.tx_stall_ms += stall;
+            if (ncm_netif->stats.tx_stall_max_ms < stall)
+            {
+                ncm_netif->stats.tx_stall_max_ms = stall;
+            }
+#endif
+#if (NCM_NETIF_TX_AGGR == 1)
+            if (ncm_netif->txq.aggr_timer != 0)
+            {
+                ncm_netif->txq.aggr_timer = 0;
+                sys_untimeout(ncm_tx_aggr_timeout, ncm_netif);
+            }
+#endif
+#if (LWIP_TIMERS == 1)
+            if (ncm_netif->txq.retry_timer != 0)
+            {
+                ncm_netif->txq.retry_timer = 0;
+                sys_untimeout(ncm_tx_retry_timeout, ncm_netif);
+            }
+#endif
+        }
+    }
+}
+
+#if (LWIP_TIMERS == 1)
+/**
+ * @brief Retries sending the queued frames, which didn't fit
+ *        in the transfer block before.
+ * @param arg: reference to the interface container structure
+ */
+static void ncm_tx_retry_timeout(void *arg)
+{
+    struct ncm_netif *ncm_netif = arg;
+
+    ncm_netif->txq.retry_timer = 0;
+    ncm_tx_drain(ncm_netif);
+}
+#endif
+
+#if (NCM_NETIF_TX_AGGR == 1)
+/**
+ * @brief Sends the held frames when they reach the aggregation deadline.
+ * @param arg: reference to the interface container structure
+ */
+static void ncm_tx_aggr_timeout(void *arg)
+{
+    struct ncm_netif *ncm_netif = arg;
+
+    ncm_netif->txq.aggr_timer = 0;
+    if (ncm_netif->txq.count > 0)
+    {
+        NCM_STATS_INC(ncm_netif, tx_aggr_deadline);
+        ncm_tx_drain(ncm_netif);
+    }
+}
+
+/**
+ * @brief Holds the frame in the transmit queue, and sends the queued frames
+ *        when they are worth a transfer, or the first one reached the deadline.
+ * @param ncm_netif: reference to the interface container structure
+ * @param p: the MAC packet to send
+ * @param cls: the priority class of the frame
+ * @return ERR_OK if the packet is sent or queued
+ *         an err_t value if the packet couldn't be sent
+ */
+static err_t ncm_tx_aggregate(struct ncm_netif *ncm_netif, struct pbuf *p, u8_t cls)
+{
+    err_t retval;
+
+    /* Make room in the queue */
+    if (ncm_netif->txq.cls[cls].count == NCM_NETIF_TXQ_SIZE)
+    {
+        NCM_STATS_INC(ncm_netif, tx_aggr_size);
+        ncm_tx_drain(ncm_netif);
+    }
+
+    retval = ncm_txq_push(ncm_netif, p, cls);
+    if (retval != ERR_OK)
+    {
+        return retval;
+    }
+
+    if (ncm_netif->txq.count == 1)
+    {
+        /* The first frame starts the deadline */
+        ncm_netif->txq.aggr_start = NCM_NOW_CYCLES();
+        if (ncm_netif->txq.aggr_timer == 0)
+        {
+            ncm_netif->txq.aggr_timer = 1;
+            sys_timeout((NCM_NETIF_TX_AGGR_US + 999) / 1000, ncm_tx_aggr_timeout, ncm_netif);
+        }
+    }
+
+    if ((ncm_netif->txq.bytes >= NCM_NETIF_TX_AGGR_SIZE) ||
+        (ncm_netif->txq.cls[cls].count == NCM_NETIF_TXQ_SIZE))
+    {
+        NCM_STATS_INC(ncm_netif, tx_aggr_size);
+        ncm_tx_drain(ncm_netif);
+    }
+    else if ((NCM_NOW_CYCLES() - ncm_netif->txq.aggr_start) >= ncm_netif->txq.aggr_cycles)
+    {
+        NCM_STATS_INC(ncm_netif, tx_aggr_deadline);
+        ncm_tx_drain(ncm_netif);
+    }
+    return ERR_OK;
+}
+#endif
+
+#if (NO_SYS == 0) && (NCM_NETIF_RX_DISPATCH == NCM_RX_DISPATCH_FRAME)
+/**
+ * @brief Drains the transmit queue in the TCP/IP thread,
+ *        after a received batch.
+ * @param arg: reference to the interface container structure
+ */
+static void ncm_tx_drain_callback(void *arg)
+{
+    struct ncm_netif *ncm_netif = arg;
+
+    ncm_netif->tx_drain_posted = 0;
+    ncm_tx_drain(ncm_netif);
+}
+#endif
+
+/**
+ * @brief This function copies the passed datagram to the NCM transfer block,
+ *        or queues it until there is space available. Never blocks.
+ * @param netif: reference of the network interface
+ * @param p: the MAC packet to send
+ * @return ERR_OK if the packet is sent or queued
+ *         an err_t value if the packet couldn't be sent
+ */
+static err_t ncm_if_output(struct netif *netif, struct pbuf *p)
+{
+    struct ncm_netif *ncm_netif = container_of(netif, struct ncm_netif, netif);
+    u8_t cls = ncm_tx_classify(ncm_netif, p);
+    err_t retval;
+
+    NCM_STATS_INC(ncm_netif, tx_class_frames[cls]);
+
+#if (NCM_NETIF_TX_AGGR == 1)
+    LWIP_UNUSED_ARG(retval);
+    return ncm_tx_aggregate(ncm_netif, p, cls);
+#else
+    /* Keep the order of frames, only send directly when none are queued */
+    ncm_tx_drain(ncm_netif);
+    if (ncm_netif->txq.count == 0)
+    {
+#if (NCM_NETIF_TX_SHAPING == 1)
+        if (ncm_tx_shape_allow(ncm_netif, cls) == 0)
+        {
+            /* The frame is held until its class has credit */
+            NCM_STATS_INC(ncm_netif, tx_class_shaped[cls]);
+            retval = ncm_txq_push(ncm_netif, p, cls);
+            ncm_tx_shape_schedule(ncm_netif);
+            return retval;
+        }
+#endif
+        retval = ncm_tx_put(ncm_netif, p);
+        if (retval != ERR_MEM)
+        {
+#if (NCM_NETIF_TX_SHAPING == 1)
+            ncm_tx_shape_charge(ncm_netif, cls, p->tot_len - ETH_PAD_SIZE);
+#endif
+            return retval;
+        }
+    }
+    return ncm_txq_push(ncm_netif, p, cls);
+#endif
+}
+
+/**
+ * @brief Measures the processing of a transfer block, from receiving
+ *        its first datagram until the stack releases the last one.
+ * @param ncm_netif: reference to the interface container structure
+ */
+static void ncm_rx_ntb_released(struct ncm_netif *ncm_netif)
+{
+#if (NCM_NETIF_STATS == 1)
+    if (ncm_netif->rx.next > 0)
+    {
+        u32_t cycles = NCM_CYCLES() - ncm_netif->rx.ntb_start;
+
+        ncm_netif->stats.rx_ntbs++;
+        ncm_netif->stats.rx_frames += ncm_netif->rx.next;
+        ncm_netif->stats.rx_ntb_cycles += cycles;
+        if (ncm_netif->stats.rx_ntb_cycles_max < cycles)
+        {
+            ncm_netif->stats.rx_ntb_cycles_max = cycles;
+        }
+    }
+#else
+    LWIP_UNUSED_ARG(ncm_netif);
+#endif
+}
+
+/**
+ * @brief Called when the stack frees a received datagram.
+ *        The last one releases the transfer block for reception.
+ * @param p: the released pbuf
+ */
+static void ncm_rx_pbuf_free(struct pbuf *p)
+{
+    struct ncm_netif *ncm_netif = &ncm_net_if;
+    u8_t released;
+    SYS_ARCH_DECL_PROTECT(lev);
+
+    LWIP_UNUSED_ARG(p);
+
+    /* The descriptors are reused when the whole transfer block is released */
+    SYS_ARCH_PROTECT(lev);
+    released = (--ncm_netif->rx.refs == 0) && (ncm_netif->rx.ntb_end != 0);
+    SYS_ARCH_UNPROTECT(lev);
+
+    if (released)
+    {
+        ncm_rx_ntb_released(ncm_netif);
+#if (NO_SYS == 0)
+        /* The thread is waiting for the release to continue reception */
+        ncm_post_event(ncm_netif, NCM_EV_RECEIVED);
+#endif
+    }
+}
+
+/**
+ * @brief Wraps a received datagram in a pbuf which references the transfer block.
+ *        The pbuf is taken from the descriptor array of the transfer block,
+ *        which is sized for the most datagrams a block can contain.
+ * @param ncm_netif: reference to the interface container structure
+ * @param dg: the Ethernet frame in the transfer block
+ * @param len: the length of the frame
+ * @return The allocated pbuf, or NULL if none is available
+ */
+static struct pbuf* ncm_rx_pbuf_alloc(struct ncm_netif *ncm_netif, uint8_t *dg, uint16_t len)
+{
+    struct pbuf_custom *pc;
+    struct pbuf *p = NULL;
+    /* The padding in front of the frame is the end of the previous datagram
+     * or the block headers, it's never written */
+    u8_t *frame = dg - ETH_PAD_SIZE;
+    u16_t frame_len = len + ETH_PAD_SIZE;
+    struct eth_hdr *ethhdr = (struct eth_hdr *)frame;
+    SYS_ARCH_DECL_PROTECT(lev);
+
+    if ((((mem_ptr_t)frame + SIZEOF_ETH_HDR) % 4) != 0)
+    {
+        /* The host didn't follow wNdpOutDivisor and wNdpOutPayloadRemainder */
+        NCM_STATS_INC(ncm_netif, rx_unaligned);
+    }
+
+    if ((frame_len >= (SIZEOF_ETH_HDR + IP_HLEN)) && (ethhdr->type == PP_HTONS(ETHTYPE_IP)) &&
+        ((IPH_OFFSET((struct ip_hdr *)(frame + SIZEOF_ETH_HDR)) & PP_HTONS(IP_MF | IP_OFFMASK)) != 0))
+    {
+        /* IP reassembly holds the fragments until the whole packet arrives,
+         * which may be in a later transfer block, so these are copied */
+        p = pbuf_alloc(PBUF_RAW, frame_len, PBUF_RAM);
+        if (p != NULL)
+        {
+            pbuf_take_at(p, dg, len, ETH_PAD_SIZE);
+        }
+        return p;
+    }
+
+    if (ncm_netif->rx.next < NCM_NETIF_RX_DESC_COUNT)
+    {
+        pc = &ncm_netif->rx.desc[ncm_netif->rx.next];
+        pc->custom_free_function = ncm_rx_pbuf_free;
+        p = pbuf_alloced_custom(PBUF_RAW, frame_len, PBUF_REF, pc, frame, frame_len);
+
+        if (p != NULL)
+        {
+#if (NCM_NETIF_STATS == 1)
+            if (ncm_netif->rx.next == 0)
+            {
+                ncm_netif->rx.ntb_start = NCM_CYCLES();
+            }
+#endif
+            ncm_netif->rx.next++;
+#if (NCM_NETIF_STATS == 1)
+            if (ncm_netif->stats.rx_desc_hwm < ncm_netif->rx.next)
+            {
+                ncm_netif->stats.rx_desc_hwm = ncm_netif->rx.next;
+            }
+#endif
+
+            SYS_ARCH_PROTECT(lev);
+            ncm_netif->rx.refs++;
+            SYS_ARCH_UNPROTECT(lev);
+        }
+    }
+    else
+    {
+        NCM_STATS_INC(ncm_netif, rx_desc_exhausted);
+    }
+    return p;
+}
+
+#if (NCM_NETIF_RX_FILTER == 1)
+/* The rule only matches frames to group (multicast or broadcast) MAC addresses */
+#define NCM_RX_RULE_GROUP       0x01
+
+/** @brief Receive filter rule, the zero fields match anything */
+struct ncm_rx_rule
+{
+    u16_t type;                 /* EtherType, network order */
+    u8_t proto;                 /* IPv4 protocol */
+    u8_t flags;                 /* NCM_RX_RULE_* flags */
+    u16_t port;                 /* transport destination port, network order */
+};
+
+/* Traffic which hosts send to every new network interface */
+static const struct ncm_rx_rule ncm_rx_rules[NCM_RX_RULE_COUNT] = {
+#if (LWIP_IPV6 == 0)
+    [NCM_RX_RULE_IPV6]  = { PP_HTONS(ETHTYPE_IPV6), 0, 0, 0 },
+#endif
+#if (LWIP_MDNS_RESPONDER == 0)
+    [NCM_RX_RULE_MDNS]  = { PP_HTONS(ETHTYPE_IP), IP_PROTO_UDP, NCM_RX_RULE_GROUP, PP_HTONS(5353) },
+#endif
+    [NCM_RX_RULE_LLMNR] = { PP_HTONS(ETHTYPE_IP), IP_PROTO_UDP, NCM_RX_RULE_GROUP, PP_HTONS(5355) },
+    [NCM_RX_RULE_SSDP]  = { PP_HTONS(ETHTYPE_IP), IP_PROTO_UDP, NCM_RX_RULE_GROUP, PP_HTONS(1900) },
+    [NCM_RX_RULE_NBNS]  = { PP_HTONS(ETHTYPE_IP), IP_PROTO_UDP, NCM_RX_RULE_GROUP, PP_HTONS(137) },
+    [NCM_RX_RULE_NBDS]  = { PP_HTONS(ETHTYPE_IP), IP_PROTO_UDP, NCM_RX_RULE_GROUP, PP_HTONS(138) },
+};
+
+/**
+ * @brief Matches the received frame against the filter rules.
+ * @param ncm_netif: reference to the interface container structure
+ * @param dg: the received Ethernet frame in the transfer block
+ * @param len: the length of the frame
+ * @return 1 if the frame is to be dropped, 0 if it's passed on
+ */
+static u8_t ncm_rx_filter(struct ncm_netif *ncm_netif, const uint8_t *dg, uint16_t len)
+{
+    const struct eth_hdr *ethhdr = (const struct eth_hdr *)(dg - ETH_PAD_SIZE);
+    u8_t group;
+    u8_t proto = 0;
+    u16_t port = 0;
+    int i;
+
+    if (len < ETH_HEADER_SIZE)
+    {
+        return 0;
+    }
+    group = ethhdr->dest.addr[0] & 1;
+
+    /* Extract the fields which are used by the rules */
+    if ((ethhdr->type == PP_HTONS(ETHTYPE_IP)) && (len >= (ETH_HEADER_SIZE + IP_HLEN)))
+    {
+        const struct ip_hdr *iphdr = (const struct ip_hdr *)(dg + ETH_HEADER_SIZE);
+        u16_t hlen = IPH_HL_BYTES(iphdr);
+
+        proto = IPH_PROTO(iphdr);
+
+        /* The ports are only in the first fragment */
+        if (((IPH_OFFSET(iphdr) & PP_HTONS(IP_OFFMASK)) == 0) &&
+            (len >= (ETH_HEADER_SIZE + hlen + 4)) &&
+            ((proto == IP_PROTO_UDP) || (proto == IP_PROTO_TCP)))
+        {
+            const u8_t *ports = (const u8_t*)iphdr + hlen;
+            port = lwip_htons((u16_t)((ports[2] << 8) | ports[3]));
+        }
+    }
+
+    for (i = 0; i < NCM_RX_RULE_COUNT; i++)
+    {
+        const struct ncm_rx_rule *rule = &ncm_rx_rules[i];
+
+        if ((rule->type == 0) || (rule->type != ethhdr->type))
+        {   continue; }
+        if ((rule->proto != 0) && (rule->proto != proto))
+        {   continue; }
+        if ((rule->port != 0) && (rule->port != port))
+        {   continue; }
+        if (((rule->flags & NCM_RX_RULE_GROUP) != 0) && (group == 0))
+        {   continue; }
+
+        NCM_STATS_INC(ncm_netif, rx_filter_hits[i]);
+        return 1;
+    }
+    return 0;
+}
+#endif
+
+#if (NCM_NETIF_RX_FASTPATH == 1)
+/**
+ * @brief Answers ICMP echo and ARP requests to the interface's address
+ *        without the stack: the reply is made from a copy of the request,
+ *        with the ICMP checksum adjusted incrementally, and it is sent
+ *        through the interface's output (classes and queue).
+ * @param ncm_netif: reference to the interface container structure
+ * @param dg: the received Ethernet frame in the transfer block
+ * @param len: the length of the frame
+ * @return 1 if the frame is answered, 0 if it has to be passed to the stack
+ */
+static u8_t ncm_rx_fastpath(struct ncm_netif *ncm_netif, uint8_t *dg, uint16_t len)
+{
+    const struct eth_hdr *ethhdr = (const struct eth_hdr *)(dg - ETH_PAD_SIZE);
+    const ip4_addr_t *ipaddr = netif_ip4_addr(&ncm_netif->netif);
+    const struct etharp_hdr *arphdr = NULL;
+    const struct ip_hdr *iphdr = NULL;
+    struct eth_hdr *reply;
+    struct pbuf *p;
+    uint8_t *dest;
+
+    if ((ethhdr->type == PP_HTONS(ETHTYPE_ARP)) &&
+        (len >= (ETH_HEADER_SIZE + SIZEOF_ETHARP_HDR)))
+    {
+        arphdr = (const struct etharp_hdr *)(dg + ETH_HEADER_SIZE);
+
+        if ((arphdr->opcode != PP_HTONS(ARP_REQUEST)) ||
+            (arphdr->hwtype != PP_HTONS(LWIP_IANA_HWTYPE_ETHERNET)) ||
+            (arphdr->proto != PP_HTONS(ETHTYPE_IP)) ||
+            (arphdr->hwlen != ETH_HWADDR_LEN) || (arphdr->protolen != sizeof(ip4_addr_t)) ||
+            (memcmp(&arphdr->dipaddr, ipaddr, sizeof(ip4_addr_t)) != 0))
+        {
+            return 0;
+        }
+    }
+    else if ((ethhdr->type == PP_HTONS(ETHTYPE_IP)) &&
+             (len >= (ETH_HEADER_SIZE + IP_HLEN + sizeof(struct icmp_echo_hdr))))
+    {
+        const struct icmp_echo_hdr *echo;
+        u16_t ip_len;
+
+        iphdr = (const struct ip_hdr *)(dg + ETH_HEADER_SIZE);
+        echo = (const struct icmp_echo_hdr *)((const u8_t*)iphdr + IP_HLEN);
+        ip_len = lwip_ntohs(IPH_LEN(iphdr));
+
+        /* Only plain echo requests, the rest is up to the stack */
+        if ((IPH_V(iphdr) != 4) || (IPH_HL_BYTES(iphdr) != IP_HLEN) ||
+            (IPH_PROTO(iphdr) != IP_PROTO_ICMP) ||
+            ((IPH_OFFSET(iphdr) & PP_HTONS(IP_MF | IP_OFFMASK)) != 0) ||
+            (ip_len > (len - ETH_HEADER_SIZE)) ||
+            (ip_len < (IP_HLEN + sizeof(struct icmp_echo_hdr))) ||
+            (!ip4_addr_cmp(&iphdr->dest, ipaddr)) ||
+            (ICMPH_TYPE(echo) != ICMP_ECHO) || (ICMPH_CODE(echo) != 0) ||
+            (NCM_CHECKSUM_ENABLED(ncm_netif, NETIF_CHECKSUM_CHECK_IP) &&
+             (inet_chksum(iphdr, IP_HLEN) != 0)))
+        {
+            return 0;
+        }
+#if (CHECKSUM_CHECK_ICMP == 1)
+        /* The incremental update is only valid for a correct checksum,
+         * the stack drops (and counts) the invalid requests */
+        if (NCM_CHECKSUM_ENABLED(ncm_netif, NETIF_CHECKSUM_CHECK_ICMP) &&
+            (inet_chksum(echo, ip_len - IP_HLEN) != 0))
+        {
+            return 0;
+        }
+#endif
+        /* The Ethernet padding isn't echoed */
+        len = ETH_HEADER_SIZE + ip_len;
+    }
+    else
+    {
+        return 0;
+    }
+
+    p = pbuf_alloc(PBUF_RAW, len + ETH_PAD_SIZE, PBUF_RAM);
+    if (p == NULL)
+    {
+        /* The stack handles the request */
+        return 0;
+    }
+
+    /* Turn the copy of the request into the reply */
+    dest = (uint8_t *)p->payload + ETH_PAD_SIZE;
+    SMEMCPY(dest, dg, len);
+    reply = (struct eth_hdr *)(dest - ETH_PAD_SIZE);
+    SMEMCPY(&reply->dest, &ethhdr->src, ETH_HWADDR_LEN);
+    SMEMCPY(&reply->src, ncm_netif->netif.hwaddr, ETH_HWADDR_LEN);
+
+    if (arphdr != NULL)
+    {
+        struct etharp_hdr *arpreply = (struct etharp_hdr *)(dest + ETH_HEADER_SIZE);
+
+        arpreply->opcode = PP_HTONS(ARP_REPLY);
+        SMEMCPY(&arpreply->dhwaddr, &arphdr->shwaddr, ETH_HWADDR_LEN);
+        SMEMCPY(&arpreply->dipaddr, &arphdr->sipaddr, sizeof(ip4_addr_t));
+        SMEMCPY(&arpreply->shwaddr, ncm_netif->netif.hwaddr, ETH_HWADDR_LEN);
+        SMEMCPY(&arpreply->sipaddr, ipaddr, sizeof(ip4_addr_t));
+
+        NCM_STATS_INC(ncm_netif, rx_fast_arp);
+    }
+    else
+    {
+        struct ip_hdr *ipreply = (struct ip_hdr *)(dest + ETH_HEADER_SIZE);
+        struct icmp_echo_hdr *echo = (struct icmp_echo_hdr *)((u8_t*)ipreply + IP_HLEN);
+
+        /* Swapping the addresses keeps the IP header checksum */
+        SMEMCPY(&ipreply->src, &iphdr->dest, sizeof(ip4_addr_t));
+        SMEMCPY(&ipreply->dest, &iphdr->src, sizeof(ip4_addr_t));
+
+        /* Adjust the checksum for the type change (RFC 1624) */
+        ICMPH_TYPE_SET(echo, ICMP_ER);
+        if (echo->chksum > PP_HTONS(0xffffU - (ICMP_ECHO << 8)))
+        {
+            echo->chksum = (u16_t)(echo->chksum + PP_HTONS(ICMP_ECHO << 8) + 1);
+        }
+        else
+        {
+            echo->chksum = (u16_t)(echo->chksum + PP_HTONS(ICMP_ECHO << 8));
+        }
+
+        NCM_STATS_INC(ncm_netif, rx_fast_echo);
+    }
+
+    /* Sent in order with the stack's frames, the errors are the same
+     * as if the stack replied */
+    (void)ncm_if_output(&ncm_netif->netif, p);
+    pbuf_free(p);
+    return 1;
+}
+#endif
+
+#if (NCM_NETIF_RX_BACKPRESSURE == 1)
+/**
+ * @brief Enters or leaves backpressure, and accounts its duration.
+ * @param ncm_netif: reference to the interface container structure
+ * @param active: 1 to hold reception, 0 to resume it
+ */
+static void ncm_rx_bp_set(struct ncm_netif *ncm_netif, u8_t active)
+{
+    if (ncm_netif->rx.bp == active)
+    {
+        return;
+    }
+    else if (active != 0)
+    {
+        NCM_STATS_INC(ncm_netif, rx_bp_enter);
+        ncm_netif->rx.bp_start = sys_now();
+    }
+    else
+    {
+        NCM_STATS_ADD(ncm_netif, rx_bp_ms, sys_now() - ncm_netif->rx.bp_start);
+    }
+    ncm_netif->rx.bp = active;
+}
+
+#if (MEMP_MEM_MALLOC == 0)
+/* The pools which only the reception uses up (the frames themselves are in the
+ * interface's descriptors). The pools used by the transmission aren't watched:
+ * the acknowledgements which free them arrive in the held transfer blocks. */
+static const memp_t ncm_rx_bp_pools[] = {
+    MEMP_PBUF_POOL,
+#if (NO_SYS == 0) && (NCM_NETIF_RX_DISPATCH == NCM_RX_DISPATCH_FRAME)
+    MEMP_TCPIP_MSG_INPKT,
+#endif
+};
+
+/**
+ * @brief Counts the free entries of a memory pool, up to a limit.
+ * @param type: the memory pool
+ * @param max: the count to stop at
+ * @return The number of free entries, at most max
+ */
+static u16_t ncm_memp_free(memp_t type, u16_t max)
+{
+    const struct memp *entry;
+    u16_t count = 0;
+    SYS_ARCH_DECL_PROTECT(lev);
+
+    SYS_ARCH_PROTECT(lev);
+    for (entry = *memp_pools[type]->tab; (entry != NULL) && (count < max); entry = entry->next)
+    {
+        count++;
+    }
+    SYS_ARCH_UNPROTECT(lev);
+    return count;
+}
+#endif
+
+/**
+ * @brief Checks the stack's receive resources against the watermarks.
+ *        Below NCM_NETIF_RX_BP_LOW free entries the transfer blocks
+ *        aren't released, until NCM_NETIF_RX_BP_HIGH entries are free again.
+ * @param ncm_netif: reference to the interface container structure
+ * @return 1 if reception has to wait, 0 if it can continue
+ */
+static u8_t ncm_rx_bp_check(struct ncm_netif *ncm_netif)
+{
+#if (MEMP_MEM_MALLOC == 0)
+    u16_t avail = NCM_NETIF_RX_BP_HIGH;
+    u8_t i;
+
+    for (i = 0; i < LWIP_ARRAYSIZE(ncm_rx_bp_pools); i++)
+    {
+        avail = ncm_memp_free(ncm_rx_bp_pools[i], avail);
+    }
+
+    if ((avail < NCM_NETIF_RX_BP_LOW) ||
+        ((ncm_netif->rx.bp != 0) && (avail < NCM_NETIF_RX_BP_HIGH)))
+    {
+        ncm_rx_bp_set(ncm_netif, 1);
+        return 1;
+    }
+#else
+    LWIP_UNUSED_ARG(ncm_netif);
+#endif
+    return 0;
+}
+#endif
+
+#if (NCM_NETIF_GRO == 1)
+/**
+ * @brief Checks whether a received frame is a TCP segment with data,
+ *        which can be merged with the adjacent segments of its flow.
+ *        The merged packet gets a new IP header checksum, so the received one
+ *        is verified here.
+ * @param ncm_netif: reference to the interface container structure
+ * @param p: the received Ethernet frame
+ * @return The TCP header of the segment, or NULL if it isn't a candidate
+ */
+static struct tcp_hdr* ncm_rx_gro_candidate(struct ncm_netif *ncm_netif, struct pbuf *p)
+{
+    struct ip_hdr *iphdr = (struct ip_hdr *)((u8_t*)p->payload + SIZEOF_ETH_HDR);
+    struct tcp_hdr *tcphdr = (struct tcp_hdr *)((u8_t*)iphdr + IP_HLEN);
+    u16_t ip_len;
+
+    if ((p->len < (SIZEOF_ETH_HDR + IP_HLEN + TCP_HLEN)) ||
+        (((struct eth_hdr *)p->payload)->type != PP_HTONS(ETHTYPE_IP)) ||
+        (IPH_V(iphdr) != 4) || (IPH_HL_BYTES(iphdr) != IP_HLEN) ||
+        (IPH_PROTO(iphdr) != IP_PROTO_TCP) ||
+        ((IPH_OFFSET(iphdr) & PP_HTONS(IP_MF | IP_OFFMASK)) != 0))
+    {
+        return NULL;
+    }
+
+    /* Only plain data segments, without Ethernet padding */
+    ip_len = lwip_ntohs(IPH_LEN(iphdr));
+    if ((ip_len != (p->len - SIZEOF_ETH_HDR)) ||
+        ((TCPH_FLAGS(tcphdr) & ~TCP_PSH) != TCP_ACK) ||
+        (TCPH_HDRLEN_BYTES(tcphdr) < TCP_HLEN) ||
+        (ip_len <= (IP_HLEN + TCPH_HDRLEN_BYTES(tcphdr))) ||
+        (NCM_CHECKSUM_ENABLED(ncm_netif, NETIF_CHECKSUM_CHECK_IP) &&
+         (inet_chksum(iphdr, IP_HLEN) != 0)))
+    {
+        return NULL;
+    }
+    return tcphdr;
+}
+
+/**
+ * @brief Calculates the payload sum of a segment from its checksum,
+ *        assuming that it's correct.
+ * @param iphdr: the IP header of the segment
+ * @param tcphdr: the TCP header of the segment
+ * @return The ones' complement sum of the payload
+ */
+static u16_t ncm_rx_gro_payload_sum(const struct ip_hdr *iphdr, const struct tcp_hdr *tcphdr)
+{
+    u16_t hlen = TCPH_HDRLEN_BYTES(tcphdr);
+    u16_t tcp_len = lwip_ntohs(IPH_LEN(iphdr)) - IP_HLEN;
+
+    /* A correct segment sums to 0xFFFF with its checksum */
+    return (u16_t)~ncm_chksum_fold(ncm_tcp_pseudo_sum(iphdr, tcp_len) + LWIP_CHKSUM(tcphdr, hlen));
+}
+
+#if (NCM_NETIF_STATS == 1)
+/**
+ * @brief Accounts a merged packet in the statistics of its flow.
+ * @param ncm_netif: reference to the interface container structure
+ * @param iphdr: the IP header of the packet
+ * @param tcphdr: the TCP header of the packet
+ */
+static void ncm_rx_gro_flow_stats(struct ncm_netif *ncm_netif,
+        const struct ip_hdr *iphdr, const struct tcp_hdr *tcphdr)
+{
+    struct ncm_gro_flow_stats *flow;
+    u8_t i;
+
+    for (i = 0; i < NCM_NETIF_GRO_FLOWS; i++)
+    {
+        flow = &ncm_netif->stats.rx_gro_flows[i];
+        if ((flow->src_addr == ip4_addr_get_u32(&iphdr->src)) &&
+            (flow->src_port == lwip_ntohs(tcphdr->src)) &&
+            (flow->dest_port == lwip_ntohs(tcphdr->dest)))
+        {   break; }
+    }
+    if (i == NCM_NETIF_GRO_FLOWS)
+    {
+        /* Replace the entries in turn */
+        flow = &ncm_netif->stats.rx_gro_flows[ncm_netif->rx.gro_flow_next];
+        ncm_netif->rx.gro_flow_next = (ncm_netif->rx.gro_flow_next + 1) % NCM_NETIF_GRO_FLOWS;
+
+        flow->src_addr = ip4_addr_get_u32(&iphdr->src);
+        flow->src_port = lwip_ntohs(tcphdr->src);
+        flow->dest_port = lwip_ntohs(tcphdr->dest);
+        flow->packets = 0;
+        flow->segments = 0;
+    }
+    flow->packets++;
+    flow->segments += ncm_netif->rx.gro_count;
+}
+#endif
+
+/**
+ * @brief Passes the merged segments to the stack. If the stack is out of
+ *        resources, the packet is held for a retry (with backpressure).
+ * @param ncm_netif: reference to the interface container structure
+ * @param p: the merged segments
+ * @return ERR_OK if the packet is passed or dropped, ERR_INPROGRESS if held
+ */
+static err_t ncm_rx_gro_input(struct ncm_netif *ncm_netif, struct pbuf *p)
+{
+    err_t err = ncm_netif->netif.input(p, &ncm_netif->netif);
+
+    if (err == ERR_OK)
+    {
+        return ERR_OK;
+    }
+#if (NCM_NETIF_RX_BACKPRESSURE == 1)
+    if (err == ERR_MEM)
+    {
+        /* It references the transfer block, which isn't released meanwhile */
+        ncm_netif->rx.gro_pending = p;
+        ncm_rx_bp_set(ncm_netif, 1);
+        NCM_STATS_INC(ncm_netif, rx_bp_held);
+        return ERR_INPROGRESS;
+    }
+#endif
+    NCM_STATS_INC(ncm_netif, rx_dropped);
+    pbuf_free(p);
+    return ERR_OK;
+}
+
+/**
+ * @brief Passes the merged segments to the stack. The headers of the first
+ *        segment are updated to the combined length, and the TCP checksum
+ *        is calculated from the payload sums stated by the segments' checksums,
+ *        so the stack's verification still covers every byte of the payload.
+ *        When the stack doesn't verify TCP checksums, it is left as is.
+ * @param ncm_netif: reference to the interface container structure
+ */
+static void ncm_rx_gro_flush(struct ncm_netif *ncm_netif)
+{
+    struct pbuf *p = ncm_netif->rx.gro;
+    struct ip_hdr *iphdr;
+    struct tcp_hdr *tcphdr;
+
+    if (p == NULL)
+    {
+        return;
+    }
+    ncm_netif->rx.gro = NULL;
+
+    iphdr = (struct ip_hdr *)((u8_t*)p->payload + SIZEOF_ETH_HDR);
+    tcphdr = (struct tcp_hdr *)((u8_t*)iphdr + IP_HLEN);
+
+    if (ncm_netif->rx.gro_count > 1)
+    {
+        u16_t tcp_len = p->tot_len - SIZEOF_ETH_HDR - IP_HLEN;
+
+        IPH_LEN_SET(iphdr, lwip_htons(IP_HLEN + tcp_len));
+        IPH_CHKSUM_SET(iphdr, 0);
+        IPH_CHKSUM_SET(iphdr, inet_chksum(iphdr, IP_HLEN));
+
+        if (NCM_CHECKSUM_ENABLED(ncm_netif, NETIF_CHECKSUM_CHECK_TCP))
+        {
+            tcphdr->chksum = 0;
+            tcphdr->chksum = (u16_t)~ncm_chksum_fold(ncm_tcp_pseudo_sum(iphdr, tcp_len) +
+                    LWIP_CHKSUM(tcphdr, TCPH_HDRLEN_BYTES(tcphdr)) + ncm_netif->rx.gro_sum);
+        }
+
+        NCM_STATS_INC(ncm_netif, rx_gro_packets);
+        NCM_STATS_ADD(ncm_netif, rx_gro_merged, ncm_netif->rx.gro_count - 1);
+    }
+#if (NCM_NETIF_STATS == 1)
+    ncm_rx_gro_flow_stats(ncm_netif, iphdr, tcphdr);
+#endif
+
+    ncm_rx_gro_input(ncm_netif, p);
+}
+
+/**
+ * @brief Merges the received frame with the preceding in-order segments
+ *        of the same TCP flow, or starts a new merge with it.
+ *        The other frames flush the merged segments, to keep the order.
+ * @param ncm_netif: reference to the interface container structure
+ * @param p: the received Ethernet frame
+ * @return 1 if the frame is taken, 0 if it has to be passed to the stack
+ */
+static u8_t ncm_rx_gro(struct ncm_netif *ncm_netif, struct pbuf *p)
+{
+    struct tcp_hdr *tcphdr = ncm_rx_gro_candidate(ncm_netif, p);
+    struct ip_hdr *iphdr = (struct ip_hdr *)((u8_t*)p->payload + SIZEOF_ETH_HDR);
+    u16_t hlen, data_len;
+    /* The payload sums are only needed if the stack verifies them */
+    u8_t chksum = NCM_CHECKSUM_ENABLED(ncm_netif, NETIF_CHECKSUM_CHECK_TCP);
+
+    if (tcphdr == NULL)
+    {
+        ncm_rx_gro_flush(ncm_netif);
+        return 0;
+    }
+    hlen = TCPH_HDRLEN_BYTES(tcphdr);
+    data_len = lwip_ntohs(IPH_LEN(iphdr)) - IP_HLEN - hlen;
+
+    if (ncm_netif->rx.gro != NULL)
+    {
+        struct pbuf *head = ncm_netif->rx.gro;
+        struct ip_hdr *hiphdr = (struct ip_hdr *)((u8_t*)head->payload + SIZEOF_ETH_HDR);
+        struct tcp_hdr *htcphdr = (struct tcp_hdr *)((u8_t*)hiphdr + IP_HLEN);
+
+        /* The next segment of the flow, with the same acknowledgement and options,
+         * which starts at an even offset if the payload sums are added */
+        if ((lwip_ntohl(tcphdr->seqno) == ncm_netif->rx.gro_seqno) &&
+            ip4_addr_cmp(&iphdr->src, &hiphdr->src) && ip4_addr_cmp(&iphdr->dest, &hiphdr->dest) &&
+            (tcphdr->src == htcphdr->src) && (tcphdr->dest == htcphdr->dest) &&
+            (tcphdr->ackno == htcphdr->ackno) && (tcphdr->wnd == htcphdr->wnd) &&
+            (TCPH_HDRLEN_BYTES(htcphdr) == hlen) &&
+            (memcmp(tcphdr + 1, htcphdr + 1, hlen - TCP_HLEN) == 0) &&
+            (!chksum || (((head->tot_len - SIZEOF_ETH_HDR - IP_HLEN - hlen) % 2) == 0)) &&
+            ((head->tot_len - SIZEOF_ETH_HDR + data_len) <= 0xFFFF))
+        {
+            if (chksum)
+            {
+                u32_t sum = (u32_t)ncm_netif->rx.gro_sum + ncm_rx_gro_payload_sum(iphdr, tcphdr);
+
+                ncm_netif->rx.gro_sum = ncm_chksum_fold(sum);
+            }
+            ncm_netif->rx.gro_seqno += data_len;
+            ncm_netif->rx.gro_count++;
+
+            /* Only the payload is appended */
+            if ((TCPH_FLAGS(tcphdr) & TCP_PSH) != 0)
+            {
+                TCPH_SET_FLAG(htcphdr, TCP_PSH);
+            }
+            pbuf_remove_header(p, SIZEOF_ETH_HDR + IP_HLEN + hlen);
+            pbuf_cat(head, p);
+
+            if (((TCPH_FLAGS(tcphdr) & TCP_PSH) != 0) ||
+                (ncm_netif->rx.gro_count >= NCM_NETIF_GRO_SEGS))
+            {
+                ncm_rx_gro_flush(ncm_netif);
+            }
+            return 1;
+        }
+        ncm_rx_gro_flush(ncm_netif);
+    }
+
+    /* Start merging from this segment */
+    ncm_netif->rx.gro = p;
+    ncm_netif->rx.gro_seqno = lwip_ntohl(tcphdr->seqno) + data_len;
+    ncm_netif->rx.gro_sum = chksum ? ncm_rx_gro_payload_sum(iphdr, tcphdr) : 0;
+    ncm_netif->rx.gro_count = 1;
+
+    if ((TCPH_FLAGS(tcphdr) & TCP_PSH) != 0)
+    {
+        ncm_rx_gro_flush(ncm_netif);
+    }
+    return 1;
+}
+#endif
+
+#if (NCM_NETIF_STATS == 1)
+/* The amount of data summed by the checksum benchmark */
+#define NCM_CHKSUM_BENCH_SIZE   1024
+
+/**
+ * @brief Converts a measured duration to processing speed.
+ * @param len: the number of processed bytes
+ * @param cycles: the CPU cycles spent on them
+ * @return The speed [bytes / 1000 cycles]
+ */
+static u32_t ncm_chksum_speed(u32_t len, u32_t cycles)
+{
+    return (cycles > 0) ? ((len * 1000) / cycles) : 0;
+}
+
+/**
+ * @brief Measures the speed of the checksum routines (LWIP_CHKSUM with aligned
+ *        and odd start, LWIP_CHKSUM_COPY) with the cycle counter. The cost of
+ *        summing is also used to estimate the cycles saved by the checksum policy.
+ * @param ncm_netif: reference to the interface container structure
+ */
+static void ncm_chksum_calibrate(struct ncm_netif *ncm_netif)
+{
+    /* The interface's own memory is summed, the contents don't matter */
+    const u8_t *src = (const u8_t *)ncm_netif;
+    struct pbuf *p;
+    u32_t start, cycles;
+
+    LWIP_ASSERT("NCM_CHKSUM_BENCH_SIZE too large", sizeof(*ncm_netif) > NCM_CHKSUM_BENCH_SIZE);
+
+    start = NCM_CYCLES();
+    (void)LWIP_CHKSUM(src, NCM_CHKSUM_BENCH_SIZE);
+    cycles = NCM_CYCLES() - start;
+    ncm_netif->stats.chksum_speed = ncm_chksum_speed(NCM_CHKSUM_BENCH_SIZE, cycles);
+#if (LWIP_CHECKSUM_CTRL_PER_NETIF == 1)
+    ncm_netif->chksum_kb_cycles = (cycles * 1024) / NCM_CHKSUM_BENCH_SIZE;
+#endif
+
+    start = NCM_CYCLES();
+    (void)LWIP_CHKSUM(src + 1, NCM_CHKSUM_BENCH_SIZE);
+    cycles = NCM_CYCLES() - start;
+    ncm_netif->stats.chksum_odd_speed = ncm_chksum_speed(NCM_CHKSUM_BENCH_SIZE, cycles);
+
+    p = pbuf_alloc(PBUF_RAW, NCM_CHKSUM_BENCH_SIZE, PBUF_RAM);
+    if (p != NULL)
+    {
+        start = NCM_CYCLES();
+        (void)LWIP_CHKSUM_COPY(p->payload, src, NCM_CHKSUM_BENCH_SIZE);
+        cycles = NCM_CYCLES() - start;
+        ncm_netif->stats.chksum_copy_speed = ncm_chksum_speed(NCM_CHKSUM_BENCH_SIZE, cycles);
+        pbuf_free(p);
+    }
+}
+#endif
+
+#if (LWIP_CHECKSUM_CTRL_PER_NETIF == 1)
+/**
+ * @brief Sets the checksum policy of the interface. The USB bulk transfers
+ *        are CRC protected, so verifying the received checksums is redundant
+ *        on this link. The checksums of sent frames are always generated,
+ *        as the host verifies them. Must be called from the lwIP core's context.
+ * @param mode: the checksum policy (NCM_CHECKSUM_*)
+ */
+void ncm_netif_set_checksum(u8_t mode)
+{
+    struct netif *netif = &ncm_net_if.netif;
+    u16_t flags = NETIF_CHECKSUM_ENABLE_ALL;
+
+    if (mode == NCM_CHECKSUM_RX_SKIP)
+    {
+        /* The IP header and the short control messages are still verified */
+        flags &= ~(NETIF_CHECKSUM_CHECK_TCP | NETIF_CHECKSUM_CHECK_UDP);
+    }
+    else if (mode == NCM_CHECKSUM_TX_ONLY)
+    {
+        flags &= ~(NETIF_CHECKSUM_CHECK_IP | NETIF_CHECKSUM_CHECK_TCP | NETIF_CHECKSUM_CHECK_UDP |
+                NETIF_CHECKSUM_CHECK_ICMP | NETIF_CHECKSUM_CHECK_ICMP6);
+    }
+    NETIF_SET_CHECKSUM_CTRL(netif, flags);
+}
+
+#if (NCM_NETIF_STATS == 1)
+/**
+ * @brief Accounts the checksum verification which the policy skips
+ *        for a received frame.
+ * @param ncm_netif: reference to the interface container structure
+ * @param dg: the received Ethernet frame in the transfer block
+ * @param len: the length of the frame
+ */
+static void ncm_rx_chksum_skipped(struct ncm_netif *ncm_netif, const uint8_t *dg, uint16_t len)
+{
+    const struct eth_hdr *ethhdr = (const struct eth_hdr *)(dg - ETH_PAD_SIZE);
+    const struct ip_hdr *iphdr = (const struct ip_hdr *)(dg + ETH_HEADER_SIZE);
+    u16_t iphlen, iplen, flag, skipped = 0;
+
+    if ((ethhdr->type != PP_HTONS(ETHTYPE_IP)) || (len < (ETH_HEADER_SIZE + IP_HLEN)) ||
+        (IPH_V(iphdr) != 4))
+    {
+        return;
+    }
+    iphlen = IPH_HL_BYTES(iphdr);
+    iplen = lwip_ntohs(IPH_LEN(iphdr));
+    if ((iplen > (len - ETH_HEADER_SIZE)) || (iphlen > iplen))
+    {
+        return;
+    }
+
+    if (!NCM_CHECKSUM_ENABLED(ncm_netif, NETIF_CHECKSUM_CHECK_IP))
+    {
+        skipped += iphlen;
+    }
+    switch (IPH_PROTO(iphdr))
+    {
+        case IP_PROTO_TCP:
+            flag = NETIF_CHECKSUM_CHECK_TCP;
+            break;
+        case IP_PROTO_UDP:
+            flag = NETIF_CHECKSUM_CHECK_UDP;
+            break;
+        case IP_PROTO_ICMP:
+            flag = NETIF_CHECKSUM_CHECK_ICMP;
+            break;
+        default:
+            flag = 0;
+            break;
+    }
+    if ((flag != 0) && !NCM_CHECKSUM_ENABLED(ncm_netif, flag))
+    {
+        skipped += iplen - iphlen;
+    }
+
+    if (skipped > 0)
+    {
+        NCM_STATS_ADD(ncm_netif, rx_chksum_skipped, skipped);
+        NCM_STATS_ADD(ncm_netif, rx_chksum_saved_cycles,
+                (skipped * ncm_netif->chksum_kb_cycles) / 1024);
+    }
+}
+#endif
+#endif
+
+/**
+ * @brief Discards the reception state of a closed USB interface: the held
+ *        datagram and the merged segments were in its transfer blocks.
+ *        The descriptors which the stack still holds are reused
+ *        once it releases them, as for an ended transfer block.
+ * @param ncm_netif: reference to the interface container structure
+ */
+static void ncm_rx_reset(struct ncm_netif *ncm_netif)
+{
+    SYS_ARCH_DECL_PROTECT(lev);
+
+    ncm_netif->rx.reset = 0;
+#if (NCM_NETIF_RX_BACKPRESSURE == 1)
+    ncm_netif->rx.pending = NULL;
+#if (NCM_NETIF_GRO == 1)
+    if (ncm_netif->rx.gro_pending != NULL)
+    {
+        pbuf_free(ncm_netif->rx.gro_pending);
+        ncm_netif->rx.gro_pending = NULL;
+    }
+#endif
+    ncm_rx_bp_set(ncm_netif, 0);
+#endif
+#if (NCM_NETIF_GRO == 1)
+    if (ncm_netif->rx.gro != NULL)
+    {
+        pbuf_free(ncm_netif->rx.gro);
+        ncm_netif->rx.gro = NULL;
+    }
+#endif
+
+    SYS_ARCH_PROTECT(lev);
+    ncm_netif->rx.ntb_end = 1;
+    SYS_ARCH_UNPROTECT(lev);
+}
+
+/**
+ * @brief Passes the received datagrams to the lwIP stack as Ethernet packets.
+ *        The pbufs reference the transfer block, which the class recycles
+ *        when USBD_NCM_GetDatagram() is called after it reported the end
+ *        of the block. Therefore that call is delayed until the stack
+ *        releases all datagrams of the block.
+ *        When the stack is out of resources, the datagram is held
+ *        in the transfer block instead of dropped, and the blocks aren't
+ *        released, so the host is NAKed until reception resumes.
+ * @param ncm_netif: reference to the interface container structure
+ * @return ERR_OK if a datagram is processed,
+ *         ERR_INPROGRESS if the transfer block is still referenced
+ *         or the stack is out of resources,
+ *         otherwise ERR_CONN
+ */
+static err_t ncm_netif_process_one(struct ncm_netif *ncm_netif)
+{
+    err_t retval = ERR_CONN;
+    uint8_t* dg;
+    uint16_t len;
+
+    if (ncm_netif->rx.reset != 0)
+    {
+        ncm_rx_reset(ncm_netif);
+    }
+
+#if (NCM_NETIF_RX_BACKPRESSURE == 1) && (NCM_NETIF_GRO == 1)
+    if (ncm_netif->rx.gro_pending != NULL)
+    {
+        /* Retry the held merged packet first, to keep the order */
+        struct pbuf *p = ncm_netif->rx.gro_pending;
+
+        ncm_netif->rx.gro_pending = NULL;
+        if (ncm_rx_gro_input(ncm_netif, p) != ERR_OK)
+        {
+            return ERR_INPROGRESS;
+        }
+    }
+#endif
+
+    if (ncm_netif->rx.ntb_end != 0)
+    {
+        if (ncm_netif->rx.refs > 0)
+        {
+            NCM_STATS_INC(ncm_netif, rx_ntb_held);
+            return ERR_INPROGRESS;
+        }
+        ncm_netif->rx.ntb_end = 0;
+        ncm_netif->rx.next = 0;
+    }
+
+#if (NCM_NETIF_RX_BACKPRESSURE == 1)
+    if (ncm_rx_bp_check(ncm_netif) != 0)
+    {
+        return ERR_INPROGRESS;
+    }
+    if (ncm_netif->rx.pending != NULL)
+    {
+        /* Retry the held datagram, it's still in the transfer block */
+        dg = ncm_netif->rx.pending;
+        len = ncm_netif->rx.pending_len;
+        ncm_netif->rx.pending = NULL;
+    }
+    else
+#endif
+    {
+        dg = USBD_NCM_GetDatagram(&ncm_netif->ncmif, &len);
+    }
+
+    if (len > 0)
+    {
+        struct pbuf *p;
+        err_t err;
+
+#if (NCM_NETIF_RX_FILTER == 1)
+        /* The rules are matched first, so their counters see all of their frames */
+        if (ncm_rx_filter(ncm_netif, dg, len) != 0)
+        {
+            return ERR_OK;
+        }
+#endif
+#if (NCM_NETIF_PACKET_FILTER == 1)
+        if ((len >= ETH_HEADER_SIZE) &&
+            (ncm_rx_mc_filtered(ncm_netif, (const struct eth_addr *)dg) != 0))
+        {
+            NCM_STATS_INC(ncm_netif, rx_mc_filtered);
+            return ERR_OK;
+        }
+#endif
+#if (NCM_NETIF_RX_FASTPATH == 1)
+        if (ncm_rx_fastpath(ncm_netif, dg, len) != 0)
+        {
+            return ERR_OK;
+        }
+#endif
+#if (LWIP_CHECKSUM_CTRL_PER_NETIF == 1) && (NCM_NETIF_STATS == 1)
+        ncm_rx_chksum_skipped(ncm_netif, dg, len);
+#endif
+        p = ncm_rx_pbuf_alloc(ncm_netif, dg, len);
+#if (NCM_NETIF_GRO == 1)
+        if ((p != NULL) && (ncm_rx_gro(ncm_netif, p) != 0))
+        {
+            return ERR_OK;
+        }
+#endif
+
+#if (NCM_NETIF_RX_BACKPRESSURE == 1) && (NCM_NETIF_GRO == 1)
+        if (ncm_netif->rx.gro_pending != NULL)
+        {
+            /* Held behind the merged packet which the stack couldn't take */
+            err = ERR_MEM;
+        }
+        else
+#endif
+        /* Process the Ethernet frame (== ethernet_input) */
+        err = (p != NULL) ? ncm_netif->netif.input(p, &ncm_netif->netif) : ERR_MEM;
+        if (err != ERR_OK)
+        {
+#if (NCM_NETIF_RX_BACKPRESSURE == 1)
+            u8_t custom = (p != NULL) && ((p->flags & PBUF_FLAG_IS_CUSTOM) != 0);
+#endif
+            if (p != NULL)
+            {
+                pbuf_free(p);
+            }
+#if (NCM_NETIF_RX_BACKPRESSURE == 1)
+            /* Out of memory, but not of descriptors (that is only fixed
+             * by releasing the block): hold the datagram and retry later */
+            if ((err == ERR_MEM) && ((custom != 0) || (ncm_netif->rx.next < NCM_NETIF_RX_DESC_COUNT)))
+            {
+                if (custom != 0)
+                {
+                    /* The descriptor is free again */
+                    ncm_netif->rx.next--;
+                }
+                ncm_netif->rx.pending = dg;
+                ncm_netif->rx.pending_len = len;
+                ncm_rx_bp_set(ncm_netif, 1);
+                NCM_STATS_INC(ncm_netif, rx_bp_held);
+                return ERR_INPROGRESS;
+            }
+#endif
+            NCM_STATS_INC(ncm_netif, rx_dropped);
+        }
+#if (NCM_NETIF_RX_BACKPRESSURE == 1)
+        else
+        {
+            ncm_rx_bp_set(ncm_netif, 0);
+        }
+#endif
+        retval = ERR_OK;
+    }
+    else
+    {
+        u8_t released;
+        SYS_ARCH_DECL_PROTECT(lev);
+
+#if (NCM_NETIF_GRO == 1)
+        /* Segments are only merged within a transfer block */
+        ncm_rx_gro_flush(ncm_netif);
+#endif
+
+        SYS_ARCH_PROTECT(lev);
+        ncm_netif->rx.ntb_end = 1;
+        released = ncm_netif->rx.refs == 0;
+        SYS_ARCH_UNPROTECT(lev);
+
+        if (released)
+        {
+            ncm_rx_ntb_released(ncm_netif);
+        }
+    }
+    return retval;
+}
+
+/**
+ * @brief Passes the received datagrams to the stack, within the budget
+ *        of NCM_NETIF_RX_BUDGET datagrams and NCM_NETIF_RX_BUDGET_US time.
+ * @param ncm_netif: reference to the interface container structure
+ * @param exhausted: set to 1 if the budget ran out before the datagrams
+ * @return The number of processed datagrams
+ */
+static u16_t ncm_netif_rx_poll(struct ncm_netif *ncm_netif, u8_t *exhausted)
+{
+    u32_t start = NCM_NOW_CYCLES();
+    u16_t count = 0;
+#if (NCM_NETIF_STATS == 1)
+    u32_t blocks = 0;
+#endif
+    err_t err;
+
+    *exhausted = 0;
+    while (1)
+    {
+        err = ncm_netif_process_one(ncm_netif);
+
+        if (err == ERR_OK)
+        {
+            count++;
+            if ((count >= NCM_NETIF_RX_BUDGET) ||
+                ((NCM_NOW_CYCLES() - start) >= ncm_netif->rx.budget_cycles))
+            {
+                NCM_STATS_INC(ncm_netif, rx_budget_exhausted);
+                *exhausted = 1;
+                break;
+            }
+        }
+        else if ((err == ERR_CONN) && (ncm_netif->rx.next > 0))
+        {
+#if (NCM_NETIF_STATS == 1)
+            blocks++;
+            if (ncm_netif->stats.rx_ring_hwm < blocks)
+            {
+                ncm_netif->stats.rx_ring_hwm = blocks;
+            }
+#endif
+            /* When the block is already released, continue with
+             * the next one which the class might have received meanwhile */
+            if (ncm_netif->rx.refs > 0)
+            {   break; }
+        }
+        else
+        {   break; }
+    }
+#if (NCM_NETIF_GRO == 1)
+    /* Don't delay the merged segments until the next round */
+    ncm_rx_gro_flush(ncm_netif);
+#endif
+    return count;
+}
+
+#if (NO_SYS == 0) && (NCM_NETIF_RX_POLL == 1)
+/**
+ * @brief Accounts the time spent in the current reception mode,
+ *        and switches to the other one.
+ * @param ncm_netif: reference to the interface container structure
+ * @param active: 1 to switch to polling, 0 to interrupt driven mode
+ */
+static void ncm_rx_poll_switch(struct ncm_netif *ncm_netif, u8_t active)
+{
+    u32_t now = sys_now();
+
+    if (active != 0)
+    {
+        NCM_STATS_INC(ncm_netif, rx_poll_enter);
+        NCM_STATS_ADD(ncm_netif, rx_irq_ms, now - ncm_netif->poll.mode_start);
+    }
+    else
+    {
+        NCM_STATS_ADD(ncm_netif, rx_poll_ms, now - ncm_netif->poll.mode_start);
+    }
+    ncm_netif->poll.mode_start = now;
+    ncm_netif->poll.idle = 0;
+    ncm_netif->poll.active = active;
+}
+
+/**
+ * @brief Selects the reception mode based on the load:
+ *        a busy round switches to polling, consecutive empty polls
+ *        switch back to the Received notifications.
+ * @param ncm_netif: reference to the interface container structure
+ * @param count: the number of datagrams processed in the last round
+ */
+static void ncm_rx_poll_update(struct ncm_netif *ncm_netif, u16_t count)
+{
+    if (ncm_netif->poll.active == 0)
+    {
+        if (count >= NCM_NETIF_RX_POLL_THRESHOLD)
+        {
+            ncm_rx_poll_switch(ncm_netif, 1);
+
+            /* Make sure the thread starts polling */
+            ncm_post_event(ncm_netif, NCM_EV_RECEIVED);
+        }
+    }
+    else if (count > 0)
+    {
+        ncm_netif->poll.idle = 0;
+    }
+    else if (++ncm_netif->poll.idle >= NCM_NETIF_RX_POLL_IDLE)
+    {
+        ncm_rx_poll_switch(ncm_netif, 0);
+
+        /* A block might have arrived since the last poll,
+         * while the notification was masked */
+        ncm_post_event(ncm_netif, NCM_EV_RECEIVED);
+    }
+}
+#endif
+
+/**
+ * @brief Sends the queued frames after a received batch.
+ * @param ncm_netif: reference to the interface container structure
+ */
+static void ncm_tx_flush(struct ncm_netif *ncm_netif)
+{
+#if (NCM_NETIF_TX_AGGR == 1)
+    if (ncm_netif->txq.count > 0)
+    {
+        NCM_STATS_INC(ncm_netif, tx_aggr_rx);
+    }
+#endif
+#if (NO_SYS == 0) && (NCM_NETIF_RX_DISPATCH == NCM_RX_DISPATCH_FRAME)
+    /* The queue is only accessed in the TCP/IP thread, where the message
+     * is processed after the received datagrams and so their responses */
+    if ((ncm_netif->tx_drain_posted == 0) && (ncm_netif->tx_drain_msg != NULL))
+    {
+        ncm_netif->tx_drain_posted = 1;
+        if (ERR_OK != tcpip_callbackmsg_trycallback(ncm_netif->tx_drain_msg))
+        {
+            ncm_netif->tx_drain_posted = 0;
+        }
+    }
+#else
+    ncm_tx_drain(ncm_netif);
+#endif
+}
+
+/**
+ * @brief Passes the received datagrams to the stack within the budget,
+ *        then sends the queued frames (e.g. the responses).
+ * @param ncm_netif: reference to the interface container structure
+ */
+static void ncm_netif_rx_batch(struct ncm_netif *ncm_netif)
+{
+    u8_t exhausted;
+    u16_t count = ncm_netif_rx_poll(ncm_netif, &exhausted);
+
+#if (NCM_NETIF_TX_AGGR == 1)
+    /* Send the responses to the batch in the same transfer block */
+    if (count > 0)
+    {
+        ncm_tx_flush(ncm_netif);
+    }
+#else
+    /* Send the frames which didn't fit in the transfer block earlier */
+    ncm_tx_flush(ncm_netif);
+#endif
+
+#if (NO_SYS == 0)
+#if (NCM_NETIF_RX_POLL == 1)
+    ncm_rx_poll_update(ncm_netif, count);
+    if (ncm_netif->poll.active != 0)
+    {
+        /* The next poll continues */
+        return;
+    }
+#else
+    LWIP_UNUSED_ARG(count);
+#endif
+    if (exhausted != 0)
+    {
+        /* The rest of the datagrams are processed in the next round */
+        ncm_post_event(ncm_netif, NCM_EV_RECEIVED);
+    }
+#else
+    LWIP_UNUSED_ARG(count);
+    LWIP_UNUSED_ARG(exhausted);
+#endif
+}
+
+#if (NO_SYS == 0) && (NCM_NETIF_RX_DISPATCH == NCM_RX_DISPATCH_MSG)
+/**
+ * @brief Processes the received transfer block in the TCP/IP thread.
+ * @param arg: reference to the interface container structure
+ */
+static void ncm_netif_rx_batch_callback(void *arg)
+{
+    struct ncm_netif *ncm_netif = arg;
+
+    ncm_netif->rx_batch_posted = 0;
+    ncm_netif_rx_batch(ncm_netif);
+}
+#endif
+
+#if (NO_SYS == 1)
+#if (LWIP_TIMERS == 1)
+/**
+ * @brief Handles the expired lwIP timeouts, and measures how late
+ *        they are handled compared to their scheduled time.
+ * @param ncm_netif: reference to the interface container structure
+ */
+static void ncm_netif_check_timeouts(struct ncm_netif *ncm_netif)
+{
+#if (NCM_NETIF_STATS == 1)
+    u32_t sleeptime;
+    s32_t late = (s32_t)(sys_now() - ncm_netif->timers.deadline);
+
+    if ((ncm_netif->timers.armed != 0) && (late > 0))
+    {
+        ncm_netif->stats.timer_late++;
+        if (ncm_netif->stats.timer_late_max_ms < (u32_t)late)
+        {
+            ncm_netif->stats.timer_late_max_ms = late;
+        }
+    }
+#else
+    LWIP_UNUSED_ARG(ncm_netif);
+#endif
+
+    sys_check_timeouts();
+
+#if (NCM_NETIF_STATS == 1)
+    sleeptime = sys_timeouts_sleeptime();
+    ncm_netif->timers.armed = sleeptime != SYS_TIMEOUTS_SLEEPTIME_INFINITE;
+    ncm_netif->timers.deadline = sys_now() + sleeptime;
+#endif
+}
+#endif
+
+/**
+ * @brief Performs the networking of the main loop: passes one round
+ *        of received datagrams to the lwIP stack as Ethernet packets,
+ *        then handles the lwIP timeouts. The round is limited by
+ *        NCM_NETIF_RX_BUDGET and NCM_NETIF_RX_BUDGET_US, so a flood
+ *        from the host can't delay the timers and the rest of the loop.
+ */
+void ncm_netif_process(void)
+{
+    struct ncm_netif *ncm_netif = &ncm_net_if;
+
+    ncm_netif_rx_batch(ncm_netif);
+
+#if (NCM_NETIF_TX_AGGR == 1)
+    /* The main loop checks the deadline more precisely than the timeout */
+    if ((ncm_netif->txq.count > 0) &&
+        ((NCM_NOW_CYCLES() - ncm_netif->txq.aggr_start) >= ncm_netif->txq.aggr_cycles))
+    {
+        NCM_STATS_INC(ncm_netif, tx_aggr_deadline);
+        ncm_tx_drain(ncm_netif);
+    }
+#endif
+
+#if (LWIP_TIMERS == 1)
+    ncm_netif_check_timeouts(ncm_netif);
+#endif
+}
+#else
+/**
+ * @brief This thread receives the NCM events in blocking mode and processes them.
+ * @param ncm_netif: reference to the interface container structure
+ */
+static void ncm_netif_thread(struct ncm_netif *ncm_netif)
+{
+    u32_t events;
+    u8_t link_changes = 0;
+#if (NCM_NETIF_RX_DISPATCH == NCM_RX_DISPATCH_MSG)
+    u8_t rx_retry = 0;
+#endif
+
+#if (NCM_NETIF_EVENT_FLAGS == 1)
+    ncm_netif->thread = xTaskGetCurrentTaskHandle();
+#endif
+
+    while (1) /* event loop */
+    {
+#if (NCM_NETIF_RX_DISPATCH == NCM_RX_DISPATCH_MSG)
+        if (rx_retry != 0)
+        {
+            /* Repost the batch when the TCP/IP thread's mailbox has room */
+            events = ncm_wait_events(ncm_netif, NCM_NETIF_RX_BP_RETRY) | NCM_EV_RECEIVED;
+            rx_retry = 0;
+        }
+        else
+#endif
+#if (NCM_NETIF_RX_BACKPRESSURE == 1)
+        if (ncm_netif->rx.bp != 0)
+        {
+            /* Retry when the stack might have freed its resources */
+            events = ncm_wait_events(ncm_netif, NCM_NETIF_RX_BP_RETRY) | NCM_EV_RECEIVED;
+        }
+        else
+#endif
+#if (NCM_NETIF_RX_POLL == 1)
+        if (ncm_netif->poll.active != 0)
+        {
+            /* Poll periodically, the other events are still signalled */
+            events = ncm_wait_events(ncm_netif, NCM_NETIF_RX_POLL_INTERVAL) | NCM_EV_RECEIVED;
+            NCM_STATS_INC(ncm_netif, rx_poll_rounds);
+        }
+        else
+#endif
+        {
+            /* Wait for next events indefinitely */
+            events = ncm_wait_events(ncm_netif, 0);
+        }
+
+        if ((events & NCM_EV_LINK) != 0)
+        {
+            u8_t changes = ncm_netif->link_changes;
+
+#if LWIP_TCPIP_CORE_LOCKING
+            LOCK_TCPIP_CORE();
+#endif
+            /* A reconnection between two wakeups is still reported
+             * to the stack as link down first */
+            if ((ncm_netif->link_up == 0) || ((u8_t)(changes - link_changes) > 1))
+            {
+                netif_set_link_down(&ncm_netif->netif);
+            }
+            if (ncm_netif->link_up != 0)
+            {
+                ncm_if_link_up(ncm_netif);
+            }
+#if LWIP_TCPIP_CORE_LOCKING
+            UNLOCK_TCPIP_CORE();
+#endif
+            link_changes = changes;
+        }
+
+        if ((events & NCM_EV_RECEIVED) != 0)
+        {
+            /* Consume all received datagrams
+             * (until the transfer block is released) */
+#if (NCM_NETIF_RX_DISPATCH == NCM_RX_DISPATCH_LOCK)
+            /* The whole block is processed in this thread,
+             * locking the lwIP core only once */
+            LOCK_TCPIP_CORE();
+            ncm_netif_rx_batch(ncm_netif);
+            UNLOCK_TCPIP_CORE();
+#elif (NCM_NETIF_RX_DISPATCH == NCM_RX_DISPATCH_MSG)
+            /* The whole block is processed in the TCP/IP thread */
+            if (ncm_netif->rx_batch_posted == 0)
+            {
+                ncm_netif->rx_batch_posted = 1;
+                if ((ncm_netif->rx_batch_msg == NULL) ||
+                    (ERR_OK != tcpip_callbackmsg_trycallback(ncm_netif->rx_batch_msg)))
+                {
+                    /* The TCP/IP thread's mailbox is full, the block waits */
+                    ncm_netif->rx_batch_posted = 0;
+                    rx_retry = 1;
+                    NCM_STATS_INC(ncm_netif, rx_batch_retry);
+                }
+            }
+#else
+            /* Each datagram is posted to the TCP/IP thread */
+            ncm_netif_rx_batch(ncm_netif);
+#endif
+        }
+    }
+}
+#endif
+
+/**
+ * @brief Initializes the NCM network interface as a DHCP server.
+ */
+void ncm_netif_init(void)
+{
+    struct ncm_netif *ncm_netif = &ncm_net_if;
+    ip4_addr_t dhcp_ip4;
+
+    ncm_netif->ncmif.App = &ncm_app;
+
+#if (__CORTEX_M >= 3)
+    /* Enable the cycle counter for the measurements and the budget */
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+    ncm_netif->rx.budget_cycles = NCM_US_TO_CYCLES(NCM_NETIF_RX_BUDGET_US);
+#if (NCM_NETIF_TX_AGGR == 1)
+    ncm_netif->txq.aggr_cycles = NCM_US_TO_CYCLES(NCM_NETIF_TX_AGGR_US);
+#endif
+#if (NCM_NETIF_TX_SHAPING == 1)
+    ncm_netif_tx_shape(NCM_TX_CLASS_HIGH, NCM_NETIF_TX_RATE_HIGH, NCM_NETIF_TX_BURST);
+    ncm_netif_tx_shape(NCM_TX_CLASS_BULK, NCM_NETIF_TX_RATE_BULK, NCM_NETIF_TX_BURST);
+#endif
+
+#if (NO_SYS == 1)
+    netif_add(&ncm_netif->netif, &ncm_if_ipaddr, &ncm_if_netmask, &ncm_if_ipaddr,
+            &ncm_netif->ncmif, &ncm_if_init, &ethernet_input);
+#elif (NCM_NETIF_RX_DISPATCH != NCM_RX_DISPATCH_FRAME)
+    /* The stack is called in a batch, in the TCP/IP thread's context */
+    netif_add(&ncm_netif->netif, &ncm_if_ipaddr, &ncm_if_netmask, &ncm_if_ipaddr,
+            &ncm_netif->ncmif, &ncm_if_init, &ethernet_input);
+#else
+    /* The received pbufs remain valid until freed,
+     * so they are passed to the TCP/IP thread without copying */
+    netif_add(&ncm_netif->netif, &ncm_if_ipaddr, &ncm_if_netmask, &ncm_if_ipaddr,
+            &ncm_netif->ncmif, &ncm_if_init, &tcpip_input);
+#endif
     netif_set_default(&ncm_netif->netif);
+#if (NCM_NETIF_STATS == 1)
+    ncm_chksum_calibrate(ncm_netif);
+#endif
+#if (LWIP_CHECKSUM_CTRL_PER_NETIF == 1)
+    ncm_netif_set_checksum(NCM_NETIF_CHECKSUM);
+#endif
 
     /* Start DHCP server with next address */
     ip4_addr_set_u32(&dhcp_ip4, ip_addr_get_ip4_u32(&ncm_if_ipaddr) + lwip_htonl(1));
-    dhcp_server_init(&ncm_netif->netif, &dhcp_ip4, 5);
+    dhcp_server_init(&ncm_netif->netif, &dhcp_ip4, NCM_DHCP_POOL_SIZE);
+    /* Link up announces the address with a gratuitous ARP */
     netif_set_up(&ncm_netif->netif);
 
 #if (NO_SYS == 0)
-    /* Create events mailbox and processing thread */
+#if (NCM_NETIF_EVENT_FLAGS == 0)
+    /* Create events mailbox */
     sys_mbox_new(&ncm_netif->events, NCM_NETIF_MBOX_SIZE);
+#endif
+    /* The messages to the TCP/IP thread are allocated once, so posting them
+     * from the NCM thread can't fail for lack of memory */
+#if (NCM_NETIF_RX_DISPATCH == NCM_RX_DISPATCH_FRAME)
+    ncm_netif->tx_drain_msg = tcpip_callbackmsg_new(ncm_tx_drain_callback, ncm_netif);
+    LWIP_ASSERT("tx_drain_msg != NULL", ncm_netif->tx_drain_msg != NULL);
+#elif (NCM_NETIF_RX_DISPATCH == NCM_RX_DISPATCH_MSG)
+    ncm_netif->rx_batch_msg = tcpip_callbackmsg_new(ncm_netif_rx_batch_callback, ncm_netif);
+    LWIP_ASSERT("rx_batch_msg != NULL", ncm_netif->rx_batch_msg != NULL);
+#endif
 
+    /* The processing thread has higher priority, so it stores its handle
+     * before the USB device (and its events) is started */
     sys_thread_new("NCM-IF", (lwip_thread_fn)ncm_netif_thread, ncm_netif,
             NCM_NETIF_STACKSIZE, NCM_NETIF_PRIO);
 #endif
@@ -29,7 +29,120 @@ extern "C"
 #endif
 
 #include <lwip/netif.h>
+#include <lwip/pbuf.h>
 #include <usbd_ncm.h>
+#include <ncm_netif_opts.h>
+
+/* Transmit priority classes, the lower is sent first */
+#define NCM_TX_CLASS_HIGH       0 /* ARP, ICMP and pure TCP ACKs */
+#define NCM_TX_CLASS_BULK       1 /* all other frames */
+#define NCM_TX_CLASS_COUNT      2
+
+/* Receive filter rules, see ncm_rx_rules */
+#define NCM_RX_RULE_IPV6        0 /* IPv6 (RS, NS, DHCPv6), without LWIP_IPV6 */
+#define NCM_RX_RULE_MDNS        1 /* multicast DNS, without LWIP_MDNS_RESPONDER */
+#define NCM_RX_RULE_LLMNR       2 /* link-local multicast name resolution */
+#define NCM_RX_RULE_SSDP        3 /* UPnP discovery */
+#define NCM_RX_RULE_NBNS        4 /* NetBIOS name service */
+#define NCM_RX_RULE_NBDS        5 /* NetBIOS datagram service */
+#define NCM_RX_RULE_COUNT       6
+
+#if (NCM_NETIF_STATS == 1)
+#if (NCM_NETIF_GRO == 1)
+/** @brief Receive offload statistics of a TCP flow */
+struct ncm_gro_flow_stats
+{
+    u32_t src_addr;             /* the host's IP address, network order */
+    u16_t src_port;             /* the host's TCP port */
+    u16_t dest_port;            /* the local TCP port */
+    u32_t packets;              /* packets passed to the stack */
+    u32_t segments;             /* received segments in the packets */
+};
+#endif
+
+/** @brief NCM interface statistics */
+struct ncm_netif_stats {
+    u32_t tx_copy_bytes;        /* bytes copied to the transfer block */
+    u32_t tx_copy_cycles;       /* CPU cycles spent on copying them */
+    u32_t tx_enqueued;          /* frames queued as the transfer block was full */
+    u32_t tx_dropped;           /* frames dropped as the queue was full */
+    u32_t tx_queue_hwm;         /* the highest number of queued frames */
+    u32_t tx_stall_ms;          /* total time the queue was not empty */
+    u32_t tx_stall_max_ms;      /* the longest time the queue was not empty */
+    u32_t tx_ntb_full;          /* frames which didn't fit in the IN transfer blocks */
+    u32_t tx_aggr_size;         /* aggregations sent for reaching the size */
+    u32_t tx_aggr_deadline;     /* aggregations sent for reaching the deadline */
+    u32_t tx_aggr_rx;           /* aggregations sent at the end of a received batch */
+    u32_t tx_tso_packets;       /* oversized packets split by the interface */
+    u32_t tx_tso_frames;        /* frames sent from the split packets */
+    u32_t tx_class_frames[NCM_TX_CLASS_COUNT];     /* frames sent in each class */
+    u32_t tx_class_queue_hwm[NCM_TX_CLASS_COUNT];  /* the highest number of queued frames */
+    u32_t tx_class_latency[NCM_TX_CLASS_COUNT];    /* total time of queued frames in the queue [cycles] */
+    u32_t tx_class_latency_max[NCM_TX_CLASS_COUNT];/* the longest time of a frame in the queue [cycles] */
+#if (NCM_NETIF_TX_SHAPING == 1)
+    u32_t tx_class_shaped[NCM_TX_CLASS_COUNT];     /* sending held by the class's rate limit */
+#endif
+    u32_t rx_dropped;           /* received frames dropped */
+    u32_t rx_ntb_held;          /* reception attempts while the stack held the transfer block */
+    u32_t rx_desc_exhausted;    /* frames dropped as all descriptors of the block were used */
+    u32_t rx_desc_hwm;          /* the most descriptors used for a transfer block */
+    u32_t rx_ntbs;              /* received transfer blocks */
+    u32_t rx_frames;            /* datagrams of the received transfer blocks */
+    u32_t rx_ntb_cycles;        /* CPU cycles from receiving to releasing the blocks */
+    u32_t rx_ntb_cycles_max;    /* the longest processing of a block */
+    u32_t rx_fast_echo;         /* ICMP echo requests answered by the fast path */
+    u32_t rx_fast_arp;          /* ARP requests answered by the fast path */
+    u32_t rx_mc_filtered;       /* received multicast frames of groups which aren't joined */
+    u32_t rx_filter_hits[NCM_RX_RULE_COUNT];       /* frames dropped by each filter rule */
+#if (NCM_NETIF_GRO == 1)
+    u32_t rx_gro_packets;       /* packets merged from several segments */
+    u32_t rx_gro_merged;        /* segments merged into a preceding one */
+    struct ncm_gro_flow_stats rx_gro_flows[NCM_NETIF_GRO_FLOWS];
+#endif
+#if (LWIP_CHECKSUM_CTRL_PER_NETIF == 1)
+    u32_t rx_chksum_skipped;    /* received bytes which the checksum policy didn't verify */
+    u32_t rx_chksum_saved_cycles;/* estimated CPU cycles saved by not verifying them */
+#endif
+    u32_t rx_unaligned;         /* received frames with unaligned IP header */
+    u32_t rx_ring_hwm;          /* the most received blocks waiting for one round */
+    u32_t ev_wakeups;           /* thread wakeups by interface events */
+    u32_t ev_latency_cycles;    /* time from the first signalled event to the wakeup */
+    u32_t ev_latency_max;       /* the longest event signalling latency */
+    u32_t ev_lost;              /* events not posted as the mailbox was full */
+    u32_t rx_batch_retry;       /* received batches reposted as the TCP/IP mailbox was full */
+    u32_t rx_bp_enter;          /* times reception was held for the stack's resources */
+    u32_t rx_bp_held;           /* datagrams held for a retry instead of dropped */
+    u32_t rx_bp_ms;             /* total time of held reception [ms] */
+    u32_t rx_budget_exhausted;  /* processing rounds ended by the budget */
+    u32_t rx_poll_enter;        /* switches to polling mode */
+    u32_t rx_poll_rounds;       /* polls in polling mode */
+    u32_t rx_poll_masked;       /* Received notifications masked by polling */
+    u32_t rx_poll_ms;           /* time spent in polling mode [ms] */
+    u32_t rx_irq_ms;            /* time spent in interrupt mode [ms] */
+    u32_t timer_late;           /* lwIP timeouts handled after their time */
+    u32_t timer_late_max_ms;    /* the worst lateness of the lwIP timeouts [ms] */
+    u32_t chksum_speed;         /* measured LWIP_CHKSUM speed [bytes / 1000 cycles] */
+    u32_t chksum_odd_speed;     /* the same, starting at an odd address */
+    u32_t chksum_copy_speed;    /* measured LWIP_CHKSUM_COPY speed [bytes / 1000 cycles] */
+};
+
+extern const struct ncm_netif_stats *const ncm_stats;
+#endif
+
+#if (NCM_NETIF_TSO == 1)
+struct tcp_pcb;
+
+err_t ncm_netif_tcp_inpacket(struct tcp_pcb *pcb);
+#endif
+
+#if (NCM_NETIF_TX_SHAPING == 1)
+void ncm_netif_tx_shape(u8_t cls, u32_t rate, u32_t burst);
+void ncm_netif_tx_port_class(u8_t index, u16_t port, u8_t cls);
+#endif
+
+#if (LWIP_CHECKSUM_CTRL_PER_NETIF == 1)
+void ncm_netif_set_checksum(u8_t mode);
+#endif
 
 extern USBD_NCM_IfHandleType *const ncm_usb_if;
 
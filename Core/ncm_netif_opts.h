@@ -0,0 +1,407 @@
+/**
+  ******************************************************************************
+  * @file    ncm_netif_opts.h
+  * @author  agent
+  * @version 0.1
+  * @date    2026-10-17
+  * @brief   USB-NCM interface default configuration
+  *
+  * Copyright (c) 2026 agent
+  *
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+#ifndef __NCM_NETIF_OPTS_H_
+#define __NCM_NETIF_OPTS_H_
+
+/* The defaults below can be overridden in lwipopts.h */
+#include <lwip/opt.h>
+
+/**
+ * NCM_NETIF_STATS==1: Maintain counters and cycle measurements
+ * of the NCM interface (uses the Cortex-M DWT cycle counter).
+ * The Cortex-M0 cores have no DWT, there the cycles are derived from
+ * sys_now(), so the short measurements are mostly zero.
+ */
+#ifndef NCM_NETIF_STATS
+#define NCM_NETIF_STATS             1
+#endif
+
+/**
+ * NCM_NETIF_MTU: The MTU of the interface. It can be lowered to save buffer
+ * memory, but not raised: the NCM class advertises 1514 byte frames
+ * (wMaxSegmentSize) and sizes its transfer blocks for them, larger frames
+ * would never fit in a datagram.
+ */
+#ifndef NCM_NETIF_MTU
+#define NCM_NETIF_MTU               1500
+#endif
+
+#if (NCM_NETIF_MTU > 1500)
+#error "NCM_NETIF_MTU above 1500 requires an NCM class with a larger wMaxSegmentSize"
+#endif
+
+/**
+ * NCM_NETIF_P2P==1: The link has only one peer, the USB host, so unicast
+ * IP packets are sent to its MAC address without ARP resolution.
+ */
+#ifndef NCM_NETIF_P2P
+#define NCM_NETIF_P2P               1
+#endif
+
+/**
+ * NCM_NETIF_TSO==1: TCP segments up to NCM_NETIF_TSO_SIZE are passed to the
+ * interface, which splits them to MSS sized frames in the transfer block
+ * (segmentation offload). The stack's IP fragmentation has to be disabled
+ * (IP_FRAG==0), as the interface fragments the other oversized packets,
+ * and the TCP connections are switched to the oversized segments by
+ * @ref ncm_netif_tcp_inpacket as LWIP_HOOK_TCP_INPACKET_PCB.
+ */
+#ifndef NCM_NETIF_TSO
+#define NCM_NETIF_TSO               0
+#endif
+
+/**
+ * NCM_NETIF_TSO_SIZE: The TCP segment size used by the stack with NCM_NETIF_TSO.
+ * The segments are allocated from the heap, MEM_SIZE has to fit them.
+ */
+#ifndef NCM_NETIF_TSO_SIZE
+#define NCM_NETIF_TSO_SIZE          (2 * (NCM_NETIF_MTU - 40))
+#endif
+
+#if (NCM_NETIF_TSO == 1) && (IP_FRAG == 1)
+#error "NCM_NETIF_TSO requires IP_FRAG 0, the interface fragments the packets"
+#endif
+
+/**
+ * NCM_NETIF_TXQ_SIZE: The number of frames which are queued (referenced)
+ * when the transfer block is full, instead of blocking the stack.
+ * Each transmit priority class has a queue of this size.
+ */
+#ifndef NCM_NETIF_TXQ_SIZE
+#define NCM_NETIF_TXQ_SIZE          8
+#endif
+
+/**
+ * NCM_NETIF_TXQ_ERR_MEM==1: Return ERR_MEM to the stack when the transmit queue
+ * is full, so TCP keeps the segment for a later attempt.
+ * NCM_NETIF_TXQ_ERR_MEM==0: Drop the frame silently (drop-tail).
+ */
+#ifndef NCM_NETIF_TXQ_ERR_MEM
+#define NCM_NETIF_TXQ_ERR_MEM       1
+#endif
+
+/**
+ * NCM_NETIF_TX_RETRY: The time between two attempts to send the queued frames
+ * while the transfer block is full [ms]. The frames are also sent
+ * with the next output or received batch.
+ */
+#ifndef NCM_NETIF_TX_RETRY
+#define NCM_NETIF_TX_RETRY          1
+#endif
+
+/**
+ * NCM_NETIF_TX_SHAPING==1: Each transmit priority class has a token bucket,
+ * which holds its frames in the transmit queue when the class exceeds its rate.
+ * The rates can be changed with @ref ncm_netif_tx_shape, and TCP or UDP ports
+ * can be assigned to classes with @ref ncm_netif_tx_port_class.
+ * Requires LWIP_TIMERS.
+ */
+#ifndef NCM_NETIF_TX_SHAPING
+#define NCM_NETIF_TX_SHAPING        1
+#endif
+
+#if (NCM_NETIF_TX_SHAPING == 1) && (LWIP_TIMERS == 0)
+#error "NCM_NETIF_TX_SHAPING requires LWIP_TIMERS for refilling the buckets"
+#endif
+
+/**
+ * NCM_NETIF_TX_RATE_HIGH, NCM_NETIF_TX_RATE_BULK: The initial rates of the
+ * transmit priority classes [bytes/s], 0 for unlimited.
+ */
+#ifndef NCM_NETIF_TX_RATE_HIGH
+#define NCM_NETIF_TX_RATE_HIGH      0
+#endif
+#ifndef NCM_NETIF_TX_RATE_BULK
+#define NCM_NETIF_TX_RATE_BULK      0
+#endif
+
+/**
+ * NCM_NETIF_TX_BURST: The initial bucket size of the classes [bytes],
+ * the amount which can be sent at once after idling.
+ */
+#ifndef NCM_NETIF_TX_BURST
+#define NCM_NETIF_TX_BURST          4096
+#endif
+
+/**
+ * NCM_NETIF_TX_PORT_RULES: The number of port to class assignments.
+ */
+#ifndef NCM_NETIF_TX_PORT_RULES
+#define NCM_NETIF_TX_PORT_RULES     4
+#endif
+
+/**
+ * NCM_NETIF_TX_AGGR==1: Frames are held in the transmit queue, until
+ * NCM_NETIF_TX_AGGR_SIZE bytes are collected, NCM_NETIF_TX_AGGR_US time passes
+ * or a received batch is processed, so they are sent in the same transfer block.
+ * Requires LWIP_TIMERS.
+ */
+#ifndef NCM_NETIF_TX_AGGR
+#define NCM_NETIF_TX_AGGR           1
+#endif
+
+/**
+ * NCM_NETIF_TX_AGGR_SIZE: The amount of held frames [bytes] which are sent
+ * immediately. It should be below the IN transfer block size (dwNtbInMaxSize).
+ */
+#ifndef NCM_NETIF_TX_AGGR_SIZE
+#define NCM_NETIF_TX_AGGR_SIZE      1024
+#endif
+
+/**
+ * NCM_NETIF_TX_AGGR_US: The longest time [us] a frame is held for aggregation.
+ * In NO_SYS==0 mode, and on Cortex-M0 cores, it's rounded up to whole milliseconds.
+ */
+#ifndef NCM_NETIF_TX_AGGR_US
+#define NCM_NETIF_TX_AGGR_US        500
+#endif
+
+/**
+ * NCM_NETIF_PACKET_FILTER==1: Received multicast frames are dropped before pbuf
+ * allocation, unless the stack joined their group (LWIP_IGMP).
+ * Without LWIP_IGMP no group is joined, so all IPv4 multicast is dropped,
+ * which the stack would otherwise accept.
+ * The host's own filters (SetEthernetPacketFilter and SetEthernetMulticastFilters)
+ * aren't forwarded by the NCM class, so the transmitted frames aren't filtered.
+ */
+#ifndef NCM_NETIF_PACKET_FILTER
+#define NCM_NETIF_PACKET_FILTER     0
+#endif
+
+/**
+ * NCM_NETIF_MC_FILTERS: The number of multicast addresses
+ * which the stack can join on the interface.
+ */
+#ifndef NCM_NETIF_MC_FILTERS
+#define NCM_NETIF_MC_FILTERS        8
+#endif
+
+/**
+ * NCM_NETIF_RX_FILTER==1: The received frames are checked against a rule table
+ * before pbuf allocation, and the host's service discovery and name resolution
+ * traffic (which the stack has no use for) is dropped right away.
+ */
+#ifndef NCM_NETIF_RX_FILTER
+#define NCM_NETIF_RX_FILTER         1
+#endif
+
+/**
+ * NCM_NETIF_RX_NTB_SIZE: The OUT transfer block size of the NCM class
+ * (dwNtbOutMaxSize), which determines how many datagrams a block can contain.
+ * It has to match the class's size, which is fixed by the USBDevice library.
+ */
+#ifndef NCM_NETIF_RX_NTB_SIZE
+#define NCM_NETIF_RX_NTB_SIZE       2048
+#endif
+
+/**
+ * NCM_NETIF_RX_DESC_COUNT: The number of pbuf descriptors for the datagrams
+ * of a received transfer block. By default it's enough for a block
+ * (NTH16 and NDP16 headers) packed with ARP sized frames,
+ * each with 2 bytes alignment and 4 bytes NDP entry.
+ * It can be lowered per board in lwipopts.h, at the cost of dropping
+ * the datagrams of a block beyond the count (rx_desc_exhausted).
+ */
+#ifndef NCM_NETIF_RX_DESC_COUNT
+#define NCM_NETIF_RX_DESC_COUNT     ((NCM_NETIF_RX_NTB_SIZE - 12 - 8) / (42 + 2 + 4))
+#endif
+
+/* Received datagram dispatch modes of the NO_SYS==0 variant */
+#define NCM_RX_DISPATCH_FRAME       0 /* tcpip_input() message per datagram */
+#define NCM_RX_DISPATCH_LOCK        1 /* the NCM thread locks the lwIP core once per block */
+#define NCM_RX_DISPATCH_MSG         2 /* one tcpip_callback() message per block */
+
+/**
+ * NCM_NETIF_RX_DISPATCH: Selects how the datagrams of a received transfer block
+ * are passed to the stack in the NO_SYS==0 variant.
+ * The lock mode requires LWIP_TCPIP_CORE_LOCKING.
+ * The frame mode allocates and frees pbufs in the NCM thread concurrently
+ * to the TCP/IP thread, so it requires SYS_LIGHTWEIGHT_PROT.
+ */
+#ifndef NCM_NETIF_RX_DISPATCH
+#if LWIP_TCPIP_CORE_LOCKING
+#define NCM_NETIF_RX_DISPATCH       NCM_RX_DISPATCH_LOCK
+#else
+#define NCM_NETIF_RX_DISPATCH       NCM_RX_DISPATCH_MSG
+#endif
+#endif
+
+#if (NO_SYS == 0) && (NCM_NETIF_RX_DISPATCH == NCM_RX_DISPATCH_FRAME) && (SYS_LIGHTWEIGHT_PROT == 0)
+#error "NCM_RX_DISPATCH_FRAME requires SYS_LIGHTWEIGHT_PROT"
+#endif
+
+/**
+ * NCM_NETIF_RX_FASTPATH==1: ICMP echo and ARP requests to the interface
+ * are answered by the interface before pbuf allocation, bypassing the stack.
+ * The replies are sent through the interface's output like the stack's frames.
+ * Not available in NCM_RX_DISPATCH_FRAME mode, where the NCM thread
+ * doesn't own the transmit path.
+ */
+#ifndef NCM_NETIF_RX_FASTPATH
+#if (NO_SYS == 0) && (NCM_NETIF_RX_DISPATCH == NCM_RX_DISPATCH_FRAME)
+#define NCM_NETIF_RX_FASTPATH       0
+#else
+#define NCM_NETIF_RX_FASTPATH       1
+#endif
+#endif
+
+#if (NCM_NETIF_RX_FASTPATH == 1) && (NO_SYS == 0) && (NCM_NETIF_RX_DISPATCH == NCM_RX_DISPATCH_FRAME)
+#error "NCM_NETIF_RX_FASTPATH is not supported with NCM_RX_DISPATCH_FRAME"
+#endif
+
+/**
+ * NCM_NETIF_EVENT_FLAGS==1: The USB interrupt signals the NCM thread
+ * by setting task notification bits, which coalesce and are never lost.
+ * NCM_NETIF_EVENT_FLAGS==0: The events are posted to a mailbox
+ * of NCM_NETIF_MBOX_SIZE depth, failed posts are counted as lost.
+ */
+#ifndef NCM_NETIF_EVENT_FLAGS
+#define NCM_NETIF_EVENT_FLAGS       1
+#endif
+
+/**
+ * NCM_NETIF_RX_BUDGET: The maximal number of received datagrams
+ * which are passed to the stack in one processing round.
+ */
+#ifndef NCM_NETIF_RX_BUDGET
+#define NCM_NETIF_RX_BUDGET         32
+#endif
+
+/**
+ * NCM_NETIF_RX_BUDGET_US: The maximal time [us] of one processing round,
+ * after which the remaining datagrams are left for the next round.
+ * On Cortex-M0 cores the time is measured in whole milliseconds.
+ */
+#ifndef NCM_NETIF_RX_BUDGET_US
+#define NCM_NETIF_RX_BUDGET_US      1000
+#endif
+
+/**
+ * NCM_NETIF_GRO==1: The adjacent in-order segments of a TCP flow in a received
+ * transfer block are merged to a single packet (receive offload), so the stack
+ * processes (and acknowledges) them at once.
+ */
+#ifndef NCM_NETIF_GRO
+#define NCM_NETIF_GRO               1
+#endif
+
+/**
+ * NCM_NETIF_GRO_SEGS: The most segments which are merged to a packet.
+ */
+#ifndef NCM_NETIF_GRO_SEGS
+#define NCM_NETIF_GRO_SEGS          8
+#endif
+
+/**
+ * NCM_NETIF_GRO_FLOWS: The number of TCP flows with merge statistics.
+ */
+#ifndef NCM_NETIF_GRO_FLOWS
+#define NCM_NETIF_GRO_FLOWS         4
+#endif
+
+/**
+ * NCM_NETIF_RX_BACKPRESSURE==1: Reception is held while the free entries of the
+ * PBUF_POOL (and with NCM_RX_DISPATCH_FRAME the TCPIP_MSG_INPKT) pool are below
+ * NCM_NETIF_RX_BP_LOW, until NCM_NETIF_RX_BP_HIGH entries are free again
+ * (requires MEMP_MEM_MALLOC==0). The pools which the transmission uses up
+ * aren't watched, as the acknowledgements freeing them would be held too.
+ * A datagram (or merged packet) which the stack can't take (ERR_MEM from
+ * a failed pbuf allocation or a full TCP/IP mailbox) is held and retried
+ * instead of dropped. The transfer blocks aren't released meanwhile,
+ * so the host's transfers are NAKed (flow control).
+ */
+#ifndef NCM_NETIF_RX_BACKPRESSURE
+#define NCM_NETIF_RX_BACKPRESSURE   1
+#endif
+
+/**
+ * NCM_NETIF_RX_BP_LOW: The free pool entries below which reception is held.
+ */
+#ifndef NCM_NETIF_RX_BP_LOW
+#define NCM_NETIF_RX_BP_LOW         2
+#endif
+
+/**
+ * NCM_NETIF_RX_BP_HIGH: The free pool entries at which reception resumes.
+ */
+#ifndef NCM_NETIF_RX_BP_HIGH
+#define NCM_NETIF_RX_BP_HIGH        4
+#endif
+
+/**
+ * NCM_NETIF_RX_BP_RETRY: The time between two reception attempts
+ * while it's held [ms] (NO_SYS==0 only).
+ */
+#ifndef NCM_NETIF_RX_BP_RETRY
+#define NCM_NETIF_RX_BP_RETRY       1
+#endif
+
+/**
+ * NCM_NETIF_RX_POLL==1: Under receive load the NCM thread masks the Received
+ * notifications of the USB interrupt, and polls the class for datagrams
+ * every NCM_NETIF_RX_POLL_INTERVAL ms instead (NO_SYS==0 only).
+ */
+#ifndef NCM_NETIF_RX_POLL
+#define NCM_NETIF_RX_POLL           1
+#endif
+
+/**
+ * NCM_NETIF_RX_POLL_THRESHOLD: The number of datagrams processed in one round
+ * which switches to polling mode. It shouldn't exceed NCM_NETIF_RX_BUDGET.
+ */
+#ifndef NCM_NETIF_RX_POLL_THRESHOLD
+#define NCM_NETIF_RX_POLL_THRESHOLD 16
+#endif
+
+/**
+ * NCM_NETIF_RX_POLL_INTERVAL: The time between two polls [ms].
+ */
+#ifndef NCM_NETIF_RX_POLL_INTERVAL
+#define NCM_NETIF_RX_POLL_INTERVAL  1
+#endif
+
+/**
+ * NCM_NETIF_RX_POLL_IDLE: The number of consecutive empty polls
+ * which switch back to interrupt driven reception.
+ */
+#ifndef NCM_NETIF_RX_POLL_IDLE
+#define NCM_NETIF_RX_POLL_IDLE      2
+#endif
+
+/* Checksum policies of the USB link, with LWIP_CHECKSUM_CTRL_PER_NETIF */
+#define NCM_CHECKSUM_FULL           0 /* all checksums are generated and verified */
+#define NCM_CHECKSUM_RX_SKIP        1 /* received TCP and UDP checksums aren't verified */
+#define NCM_CHECKSUM_TX_ONLY        2 /* no received checksum is verified */
+
+/**
+ * NCM_NETIF_CHECKSUM: The initial checksum policy of the interface,
+ * which can be changed with @ref ncm_netif_set_checksum.
+ * All checksums are verified by default. The USB bulk transfers are CRC
+ * protected, so the application may select NCM_CHECKSUM_RX_SKIP instead,
+ * which also spares the GRO payload sums.
+ */
+#ifndef NCM_NETIF_CHECKSUM
+#define NCM_NETIF_CHECKSUM          NCM_CHECKSUM_FULL
+#endif
+
+#endif /* __NCM_NETIF_OPTS_H_ */
@@ -0,0 +1,184 @@
+/**
+  ******************************************************************************
+  * @file    chksum_test.c
+  * @author  agent
+  * @version 0.1
+  * @date    2026-10-17
+  * @brief   Host test of the word-wise internet checksum routines
+  *
+  * Copyright (c) 2026 agent
+  *
+  * Licensed under the Apache License, Version 2.0 (the "License");
+  * you may not use this file except in compliance with the License.
+  * You may obtain a copy of the License at
+  *
+  *     http://www.apache.org/licenses/LICENSE-2.0
+  *
+  * Unless required by applicable law or agreed to in writing, software
+  * distributed under the License is distributed on an "AS IS" BASIS,
+  * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  * See the License for the specific language governing permissions and
+  * limitations under the License.
+  */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The routines under test, from Core/arch/chksum.c */
+uint16_t arch_chksum(const void *dataptr, int len);
+uint16_t arch_chksum_copy(void *dst, const void *src, uint16_t len);
+
+#define TEST_BUFFER_SIZE    (0x10000 + 16)
+#define TEST_GUARD_SIZE     8
+#define TEST_GUARD_BYTE     0xA5
+#define TEST_RANDOM_ROUNDS  100000
+
+static uint8_t src_buffer[TEST_BUFFER_SIZE];
+static uint8_t dst_buffer[TEST_BUFFER_SIZE + 2 * TEST_GUARD_SIZE];
+static unsigned failures;
+
+/**
+ * @brief The reference checksum: lwip_standard_chksum() of lwIP
+ *        with LWIP_CHKSUM_ALGORITHM 2.
+ * @param dataptr: the start of the data
+ * @param len: the length of the data
+ * @return The 16-bit one's complement sum (not inverted)
+ */
+static uint16_t ref_chksum(const void *dataptr, int len)
+{
+    const uint8_t *pb = (const uint8_t *)dataptr;
+    const uint16_t *ps;
+    uint16_t t = 0;
+    uint32_t sum = 0;
+    int odd = ((uintptr_t)pb & 1);
+
+    if (odd && (len > 0))
+    {
+        ((uint8_t *)&t)[1] = *pb++;
+        len--;
+    }
+    ps = (const uint16_t *)(const void *)pb;
+    while (len > 1)
+    {
+        sum += *ps++;
+        len -= 2;
+    }
+    if (len > 0)
+    {
+        ((uint8_t *)&t)[0] = *(const uint8_t *)ps;
+    }
+    sum += t;
+
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    if (odd)
+    {
+        sum = ((sum & 0xFF) << 8) | ((sum & 0xFF00) >> 8);
+    }
+    return (uint16_t)sum;
+}
+
+/**
+ * @brief Checks both routines on one memory area against the reference.
+ * @param offset: the start of the data in the source buffer
+ * @param dst_offset: the start of the copy in the destination buffer
+ * @param len: the length of the data
+ */
+static void test_area(unsigned offset, unsigned dst_offset, unsigned len)
+{
+    const uint8_t *src = &src_buffer[offset];
+    uint8_t *dst = &dst_buffer[TEST_GUARD_SIZE + dst_offset];
+    uint16_t expected = ref_chksum(src, len);
+    uint16_t sum;
+    unsigned i;
+
+    sum = arch_chksum(src, len);
+    if (sum != expected)
+    {
+        printf("arch_chksum(offset %u, len %u): 0x%04X, expected 0x%04X\n",
+                offset, len, sum, expected);
+        failures++;
+    }
+
+    if (len > 0xFFFF)
+    {
+        return;
+    }
+    memset(dst_buffer, TEST_GUARD_BYTE, sizeof(dst_buffer));
+    sum = arch_chksum_copy(dst, src, (uint16_t)len);
+    if (sum != expected)
+    {
+        printf("arch_chksum_copy(offset %u/%u, len %u): 0x%04X, expected 0x%04X\n",
+                offset, dst_offset, len, sum, expected);
+        failures++;
+    }
+    if (memcmp(dst, src, len) != 0)
+    {
+        printf("arch_chksum_copy(offset %u/%u, len %u): wrong copy\n",
+                offset, dst_offset, len);
+        failures++;
+    }
+    for (i = 0; i < TEST_GUARD_SIZE; i++)
+    {
+        if ((dst[-1 - (int)i] != TEST_GUARD_BYTE) || (dst[len + i] != TEST_GUARD_BYTE))
+        {
+            printf("arch_chksum_copy(offset %u/%u, len %u): written out of bounds\n",
+                    offset, dst_offset, len);
+            failures++;
+            break;
+        }
+    }
+}
+
+int main(void)
+{
+    unsigned offset, dst_offset, len, i;
+
+    srand(2018);
+    for (i = 0; i < sizeof(src_buffer); i++)
+    {
+        src_buffer[i] = (uint8_t)rand();
+    }
+
+    /* All short lengths at every alignment */
+    for (offset = 0; offset < 8; offset++)
+    {
+        for (dst_offset = 0; dst_offset < 8; dst_offset++)
+        {
+            for (len = 0; len <= 128; len++)
+            {
+                test_area(offset, dst_offset, len);
+            }
+        }
+    }
+
+    /* All-ones data, where the carries add up the most */
+    memset(src_buffer, 0xFF, sizeof(src_buffer));
+    for (offset = 0; offset < 4; offset++)
+    {
+        test_area(offset, 0, 0xFFFF);
+        test_area(offset, 0, 0x10000);
+    }
+
+    /* Random offsets and lengths */
+    for (i = 0; i < sizeof(src_buffer); i++)
+    {
+        src_buffer[i] = (uint8_t)rand();
+    }
+    for (i = 0; i < TEST_RANDOM_ROUNDS; i++)
+    {
+        offset = rand() % 16;
+        dst_offset = rand() % 16;
+        len = (i % 16) ? (rand() % 2048) : (rand() % 0x10000);
+        test_area(offset, dst_offset, len);
+    }
+
+    if (failures != 0)
+    {
+        printf("chksum_test: %u failures\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("chksum_test: passed\n");
+    return EXIT_SUCCESS;
+}